@@ -0,0 +1,96 @@
+/*
+ * Low-latency receiving. See busy.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+# define HAVE_AFFINITY
+#endif
+
+#include "busy.h"
+
+/* See busy.h */
+int
+busysock(int s)
+{
+	int flags;
+
+	flags = fcntl(s, F_GETFL, 0);
+	if (flags == -1) {
+		return -1;
+	}
+
+	if (-1 == fcntl(s, F_SETFL, flags | O_NONBLOCK)) {
+		return -1;
+	}
+
+#ifdef SO_BUSY_POLL
+	{
+		static int warned;
+		int usec;
+
+		usec = BUSY_POLL_USEC;
+
+		if (-1 == setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec) && !warned) {
+			perror("SO_BUSY_POLL");
+			warned = 1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/* See busy.h */
+int
+rtthread(int cpu, int prio)
+{
+	if (cpu != -1) {
+#ifdef HAVE_AFFINITY
+		cpu_set_t set;
+		int e;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		e = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+		if (e != 0) {
+			errno = e;
+			perror("pthread_setaffinity_np");
+			return -1;
+		}
+#else
+		fprintf(stderr, "CPU pinning is not supported\n");
+		return -1;
+#endif
+	}
+
+	if (prio != 0) {
+		struct sched_param sp;
+		int e;
+
+		memset(&sp, 0, sizeof sp);
+		sp.sched_priority = prio;
+
+		e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (e != 0) {
+			errno = e;
+			perror("SCHED_FIFO");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
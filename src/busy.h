@@ -0,0 +1,37 @@
+/*
+ * Low-latency receiving, for the -b busy-poll modes.
+ *
+ * Rather than sleep until a socket becomes readable, a busy-polling loop
+ * spins on a nonblocking receive, trading a CPU for the wakeup latency.
+ * The kernel may also be asked to busy-poll the device queue itself
+ * (SO_BUSY_POLL), and the spinning thread may be pinned to a CPU and
+ * given a real-time priority so that it is not preempted.
+ */
+
+#ifndef DG_BUSY_H
+#define DG_BUSY_H
+
+/*
+ * How long the kernel should busy-poll the device queue on each receive,
+ * in microseconds, where SO_BUSY_POLL is available.
+ */
+#define BUSY_POLL_USEC 50
+
+/*
+ * Make s nonblocking, and ask for SO_BUSY_POLL. Failure to set SO_BUSY_POLL
+ * (which needs CAP_NET_ADMIN to raise above net.core.busy_read) is reported
+ * once, and is not an error. Returns -1 on error, with errno set.
+ */
+int
+busysock(int s);
+
+/*
+ * Pin the calling thread to the given CPU, unless cpu is -1, and run it
+ * under SCHED_FIFO at the given priority, unless prio is 0. Returns -1
+ * on error, having printed a diagnostic.
+ */
+int
+rtthread(int cpu, int prio);
+
+#endif
+
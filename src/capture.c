@@ -0,0 +1,117 @@
+/*
+ * Binary capture of per-ping results. See capture.h.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "clock.h"
+#include "capture.h"
+
+/* enough to write a few seconds at 1kHz at a time */
+#define CAP_BUFSZ (1 << 17)
+
+/* See capture.h */
+FILE *
+capopen(const char *path, int64_t interval)
+{
+	struct caphdr h;
+	FILE *f;
+
+	assert(path != NULL);
+
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		return NULL;
+	}
+
+	if (0 != setvbuf(f, NULL, _IOFBF, CAP_BUFSZ)) {
+		goto error;
+	}
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, CAP_MAGIC, sizeof CAP_MAGIC);
+	h.version  = CAP_VERSION;
+	h.recsize  = sizeof (struct caprec);
+	h.epoch    = clockreal() - clocknow();
+	h.interval = interval;
+
+	if (1 != fwrite(&h, sizeof h, 1, f)) {
+		goto error;
+	}
+
+	return f;
+
+error:
+
+	{
+		int e;
+
+		e = errno;
+		(void) fclose(f);
+		errno = e;
+	}
+
+	return NULL;
+}
+
+/* See capture.h */
+int
+capwrite(FILE *f, const struct caprec *r)
+{
+	assert(f != NULL);
+	assert(r != NULL);
+
+	if (1 != fwrite(r, sizeof *r, 1, f)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* See capture.h */
+int
+capclose(FILE *f)
+{
+	assert(f != NULL);
+
+	if (0 != fclose(f)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* See capture.h */
+int
+capcheck(const void *p, size_t len, size_t *n)
+{
+	const struct caphdr *h;
+
+	assert(p != NULL);
+	assert(n != NULL);
+
+	if (len < sizeof *h) {
+		return -1;
+	}
+
+	h = p;
+
+	if (0 != memcmp(h->magic, CAP_MAGIC, sizeof CAP_MAGIC)) {
+		return -1;
+	}
+
+	if (h->version != CAP_VERSION || h->recsize != sizeof (struct caprec)) {
+		return -1;
+	}
+
+	/* a capture cut short mid-record is read up to the last whole record */
+	*n = (len - sizeof *h) / sizeof (struct caprec);
+
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Binary capture of per-ping results, for dgping and stping -w, and
+ * for reading back by pingstat.
+ *
+ * A capture is a struct caphdr followed by a struct caprec for each ping
+ * resolved, in the order they were resolved (answered, or timed out), and
+ * for each reply that could not be matched to a ping. Both are fixed size
+ * and in host byte order, so a capture may be mapped and read in place.
+ * Times are in ns, by clock.h's clocknow().
+ */
+
+#ifndef DG_CAPTURE_H
+#define DG_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CAP_MAGIC   "PINGCAP"
+#define CAP_VERSION 2
+
+struct caphdr {
+	char magic[8];    /* CAP_MAGIC, with its '\0' */
+	uint32_t version; /* CAP_VERSION */
+	uint32_t recsize; /* sizeof (struct caprec) */
+	int64_t epoch;    /* add to a time to give the time of day */
+	int64_t interval; /* between pings, as requested */
+};
+
+enum capstatus {
+	CAP_REPLY,    /* answered */
+	CAP_TIMEOUT,  /* never answered; recv is when it was given up */
+	CAP_INVALID,  /* a reply which failed validation; only recv and size are set */
+	CAP_UNMATCHED /* a valid reply to no outstanding ping; a duplicate or too late */
+};
+
+struct caprec {
+	int64_t sent;    /* 0 for CAP_INVALID and CAP_UNMATCHED, and CAP_TIMEOUT with -e */
+	int64_t recv;    /* when resolved; not decreasing through a capture */
+	uint64_t n;      /* the number of pings sent before this one */
+	uint64_t seq;    /* in full for version 2 messages, else 16 bits */
+	uint32_t size;   /* bytes received, or 0 */
+	uint8_t status;  /* enum capstatus */
+	uint8_t pad[3];
+};
+
+/*
+ * Create (or truncate) a capture at path, and write its header.
+ * Returns NULL on error, with errno set.
+ */
+FILE *
+capopen(const char *path, int64_t interval);
+
+/*
+ * Records are buffered; the buffer is flushed by capclose().
+ * These return -1 on error, with errno set.
+ */
+int
+capwrite(FILE *f, const struct caprec *r);
+
+int
+capclose(FILE *f);
+
+/*
+ * Check the header of a capture of len bytes, mapped at p, and give the
+ * number of records following it. Returns -1 if it is not a capture
+ * this version can read.
+ */
+int
+capcheck(const void *p, size_t len, size_t *n);
+
+#endif
@@ -0,0 +1,409 @@
+/*
+ * Checksum kernels. See cksum.h.
+ *
+ * The reference kernels are portable C. The x86 kernels are compiled for
+ * their instruction sets by function attributes, so the rest of the
+ * program needs no particular -m flags, and each is called only once
+ * the CPU is known to support it.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cksum.h"
+
+#ifdef HAVE_SIMD
+# include <immintrin.h>
+#endif
+
+/*
+ * 359 words is the most which cannot overflow b from reduced sums.
+ */
+static void
+f32_scalar(struct f32 *f, const uint8_t *p, size_t len)
+{
+	uint32_t a, b;
+
+	a = f->a;
+	b = f->b;
+
+	while (len > 1) {
+		size_t n;
+
+		n = len / 2 < 359 ? len / 2 : 359;
+		len -= n * 2;
+
+		for (; n > 0; n--) {
+			a += (uint32_t) p[0] << 8 | p[1];
+			b += a;
+			p += 2;
+		}
+
+		a %= 65535;
+		b %= 65535;
+	}
+
+	if (len == 1) {
+		a += (uint32_t) p[0] << 8;
+		b += a;
+
+		a %= 65535;
+		b %= 65535;
+	}
+
+	f->a = a;
+	f->b = b;
+}
+
+/* CRC-32C for each nibble, reflected */
+static const uint32_t crctab[16] = {
+	0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1,
+	0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+	0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9,
+	0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75
+};
+
+static uint32_t
+crc_scalar(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+
+	while (len-- > 0) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crctab[crc & 0xf];
+		crc = (crc >> 4) ^ crctab[crc & 0xf];
+	}
+
+	return ~crc;
+}
+
+static int
+always(void)
+{
+	return 1;
+}
+
+#ifdef HAVE_SIMD
+
+/*
+ * Vector steps per block. The sums are kept per 32-bit lane within a
+ * block, and the running sum of a (vaa, for b) grows as the square of
+ * the block length; 128 steps of two words per lane stays within 2^32.
+ */
+#define F32_BLOCK 128
+
+static int
+has_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2") != 0;
+}
+
+static int
+has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+}
+
+static int
+has_sse42(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2") != 0;
+}
+
+__attribute__((target("sse2")))
+static uint64_t
+hsum128(__m128i v)
+{
+	uint32_t x[4];
+
+	_mm_storeu_si128((__m128i *) x, v);
+
+	return (uint64_t) x[0] + x[1] + x[2] + x[3];
+}
+
+/*
+ * Each step takes 8 words: a gains their sum, and b gains 8a and each
+ * word weighted by its distance from the end of the step. Bytes are
+ * widened to 16 bits, and pmaddwd weights each high byte by 256 times
+ * its word's weight, and each low byte by the weight, giving whole words.
+ */
+__attribute__((target("sse2")))
+static void
+f32_sse2(struct f32 *f, const uint8_t *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one  = _mm_setr_epi16(1 << 8, 1, 1 << 8, 1, 1 << 8, 1, 1 << 8, 1);
+	const __m128i wlo  = _mm_setr_epi16(8 << 8, 8, 7 << 8, 7, 6 << 8, 6, 5 << 8, 5);
+	const __m128i whi  = _mm_setr_epi16(4 << 8, 4, 3 << 8, 3, 2 << 8, 2, 1 << 8, 1);
+	uint64_t a, b;
+
+	a = f->a;
+	b = f->b;
+
+	while (len >= 16) {
+		__m128i va, vaa, vb;
+		size_t k, n;
+
+		n = len / 16 < F32_BLOCK ? len / 16 : F32_BLOCK;
+		len -= n * 16;
+
+		va  = zero;
+		vaa = zero;
+		vb  = zero;
+
+		for (k = 0; k < n; k++) {
+			__m128i v, lo, hi;
+
+			v  = _mm_loadu_si128((const __m128i *) p);
+			lo = _mm_unpacklo_epi8(v, zero);
+			hi = _mm_unpackhi_epi8(v, zero);
+
+			vaa = _mm_add_epi32(vaa, va);
+			va  = _mm_add_epi32(va, _mm_add_epi32(_mm_madd_epi16(lo, one), _mm_madd_epi16(hi, one)));
+			vb  = _mm_add_epi32(vb, _mm_add_epi32(_mm_madd_epi16(lo, wlo), _mm_madd_epi16(hi, whi)));
+
+			p += 16;
+		}
+
+		b += 8 * n * a + 8 * hsum128(vaa) + hsum128(vb);
+		a += hsum128(va);
+
+		a %= 65535;
+		b %= 65535;
+	}
+
+	f->a = a;
+	f->b = b;
+
+	f32_scalar(f, p, len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+hsum256(__m256i v)
+{
+	uint32_t x[8];
+
+	_mm256_storeu_si256((__m256i *) x, v);
+
+	return (uint64_t) x[0] + x[1] + x[2] + x[3]
+	     + (uint64_t) x[4] + x[5] + x[6] + x[7];
+}
+
+/*
+ * As for f32_sse2(), with 16 words per step. Bytes are widened in order
+ * by vpmovzxbw, rather than unpacked within each 128-bit lane.
+ */
+__attribute__((target("avx2")))
+static void
+f32_avx2(struct f32 *f, const uint8_t *p, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one  = _mm256_setr_epi16(1 << 8, 1, 1 << 8, 1, 1 << 8, 1, 1 << 8, 1,
+		1 << 8, 1, 1 << 8, 1, 1 << 8, 1, 1 << 8, 1);
+	const __m256i wlo  = _mm256_setr_epi16(16 << 8, 16, 15 << 8, 15, 14 << 8, 14, 13 << 8, 13,
+		12 << 8, 12, 11 << 8, 11, 10 << 8, 10, 9 << 8, 9);
+	const __m256i whi  = _mm256_setr_epi16(8 << 8, 8, 7 << 8, 7, 6 << 8, 6, 5 << 8, 5,
+		4 << 8, 4, 3 << 8, 3, 2 << 8, 2, 1 << 8, 1);
+	uint64_t a, b;
+
+	a = f->a;
+	b = f->b;
+
+	while (len >= 32) {
+		__m256i va, vaa, vb;
+		size_t k, n;
+
+		n = len / 32 < F32_BLOCK ? len / 32 : F32_BLOCK;
+		len -= n * 32;
+
+		va  = zero;
+		vaa = zero;
+		vb  = zero;
+
+		for (k = 0; k < n; k++) {
+			__m256i lo, hi;
+
+			lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p));
+			hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (p + 16)));
+
+			vaa = _mm256_add_epi32(vaa, va);
+			va  = _mm256_add_epi32(va, _mm256_add_epi32(_mm256_madd_epi16(lo, one), _mm256_madd_epi16(hi, one)));
+			vb  = _mm256_add_epi32(vb, _mm256_add_epi32(_mm256_madd_epi16(lo, wlo), _mm256_madd_epi16(hi, whi)));
+
+			p += 32;
+		}
+
+		b += 16 * n * a + 16 * hsum256(vaa) + hsum256(vb);
+		a += hsum256(va);
+
+		a %= 65535;
+		b %= 65535;
+	}
+
+	f->a = a;
+	f->b = b;
+
+	f32_scalar(f, p, len);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+
+#if defined(__x86_64__)
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof v);
+		crc = (uint32_t) _mm_crc32_u64(crc, v);
+	}
+#endif
+
+	for (; len >= 4; len -= 4, p += 4) {
+		uint32_t v;
+
+		memcpy(&v, p, sizeof v);
+		crc = _mm_crc32_u32(crc, v);
+	}
+
+	for (; len > 0; len--, p++) {
+		crc = _mm_crc32_u8(crc, *p);
+	}
+
+	return ~crc;
+}
+
+#endif
+
+/* in order of preference, least first */
+static const struct cksumkern kerns[] = {
+	{ "f32/scalar",    always,    f32_scalar, NULL        },
+	{ "crc32c/scalar", always,    NULL,       crc_scalar  },
+#ifdef HAVE_SIMD
+	{ "f32/sse2",      has_sse2,  f32_sse2,   NULL        },
+	{ "f32/avx2",      has_avx2,  f32_avx2,   NULL        },
+	{ "crc32c/sse4.2", has_sse42, NULL,       crc_sse42   },
+#endif
+};
+
+#ifdef HAVE_SIMD
+
+static void
+f32first(struct f32 *f, const uint8_t *p, size_t len);
+
+static uint32_t
+crcfirst(uint32_t crc, const uint8_t *p, size_t len);
+
+/*
+ * The kernels in use, chosen on first call. Threads may race to choose,
+ * but all choose the same.
+ */
+static void (*f32kern)(struct f32 *f, const uint8_t *p, size_t len) = f32first;
+static uint32_t (*crckern)(uint32_t crc, const uint8_t *p, size_t len) = crcfirst;
+
+static const struct cksumkern *
+pick(int crc)
+{
+	const struct cksumkern *k;
+	size_t i;
+
+	k = NULL;
+
+	for (i = 0; i < sizeof kerns / sizeof *kerns; i++) {
+		if ((crc ? kerns[i].crc == NULL : kerns[i].f32 == NULL) || !kerns[i].supported()) {
+			continue;
+		}
+
+		k = &kerns[i];
+	}
+
+	assert(k != NULL);
+
+	return k;
+}
+
+static void
+f32first(struct f32 *f, const uint8_t *p, size_t len)
+{
+	void (*kern)(struct f32 *f, const uint8_t *p, size_t len);
+
+	kern = pick(0)->f32;
+	__atomic_store_n(&f32kern, kern, __ATOMIC_RELAXED);
+
+	kern(f, p, len);
+}
+
+static uint32_t
+crcfirst(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t (*kern)(uint32_t crc, const uint8_t *p, size_t len);
+
+	kern = pick(1)->crc;
+	__atomic_store_n(&crckern, kern, __ATOMIC_RELAXED);
+
+	return kern(crc, p, len);
+}
+
+#endif
+
+/* See cksum.h */
+void
+f32add(struct f32 *f, const void *buf, size_t len)
+{
+	assert(f != NULL);
+	assert(buf != NULL || len == 0);
+
+#ifdef HAVE_SIMD
+	__atomic_load_n(&f32kern, __ATOMIC_RELAXED)(f, buf, len);
+#else
+	f32_scalar(f, buf, len);
+#endif
+}
+
+/* See cksum.h */
+uint32_t
+f32sum(const struct f32 *f)
+{
+	uint32_t a, b;
+
+	assert(f != NULL);
+	assert(f->a < 65535 && f->b < 65535);
+
+	a = f->a != 0 ? f->a : 0xffff;
+	b = f->b != 0 ? f->b : 0xffff;
+
+	return b << 16 | a;
+}
+
+/* See cksum.h */
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	assert(buf != NULL || len == 0);
+
+#ifdef HAVE_SIMD
+	return __atomic_load_n(&crckern, __ATOMIC_RELAXED)(crc, buf, len);
+#else
+	return crc_scalar(crc, buf, len);
+#endif
+}
+
+/* See cksum.h */
+const struct cksumkern *
+cksumkerns(size_t *n)
+{
+	assert(n != NULL);
+
+	*n = sizeof kerns / sizeof *kerns;
+
+	return kerns;
+}
@@ -0,0 +1,66 @@
+/*
+ * Checksums over version 2 messages (see common.h), with kernels for
+ * particular instruction sets. The fastest kernel the CPU supports is
+ * chosen on first use.
+ *
+ * HAVE_SIMD is defined when x86 kernels are available at build time.
+ * Whether the running CPU supports each is established by its supported().
+ */
+
+#ifndef DG_CKSUM_H
+#define DG_CKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) \
+	&& !defined(__EMSCRIPTEN__) && !defined(NO_SIMD)
+# define HAVE_SIMD
+#endif
+
+/*
+ * Running sums for Fletcher-32 over big-endian 16-bit words, mod 65535.
+ * A message may be taken in several parts, but only the last may be of
+ * odd length; a final odd byte is taken as the high half of a word.
+ * A zero-initialised struct f32 is the start of a message.
+ */
+struct f32 {
+	uint32_t a;
+	uint32_t b;
+};
+
+void
+f32add(struct f32 *f, const void *buf, size_t len);
+
+/*
+ * The checksum for the sums so far. A sum of 0 is given as 0xffff,
+ * as by end-around carry.
+ */
+uint32_t
+f32sum(const struct f32 *f);
+
+/*
+ * CRC-32C (Castagnoli), continuing from crc over len bytes.
+ * A message starts from a crc of 0.
+ */
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Each kernel, for benchmarking. Exactly one of f32 and crc is set.
+ */
+struct cksumkern {
+	const char *name;
+	int (*supported)(void);
+	void (*f32)(struct f32 *f, const uint8_t *p, size_t len);
+	uint32_t (*crc)(uint32_t crc, const uint8_t *p, size_t len);
+};
+
+/*
+ * All kernels built in, whether or not the CPU supports them, with the
+ * reference kernels first. n is set to the number of entries.
+ */
+const struct cksumkern *
+cksumkerns(size_t *n);
+
+#endif
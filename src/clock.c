@@ -0,0 +1,86 @@
+/*
+ * A monotonic clock in integer nanoseconds. See clock.h.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <sys/time.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+#include "clock.h"
+
+#if defined(USE_MONOTONIC_RAW) && defined(CLOCK_MONOTONIC_RAW)
+# define CLOCK_ID CLOCK_MONOTONIC_RAW
+#else
+# define CLOCK_ID CLOCK_MONOTONIC
+#endif
+
+/* See clock.h */
+int64_t
+clocknow(void)
+{
+	struct timespec ts;
+
+	if (-1 == clock_gettime(CLOCK_ID, &ts)) {
+		perror("clock_gettime");
+		exit(EXIT_FAILURE);
+	}
+
+	return (int64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* See clock.h */
+int64_t
+clockreal(void)
+{
+	struct timespec ts;
+
+	if (-1 == clock_gettime(CLOCK_REALTIME, &ts)) {
+		perror("clock_gettime");
+		exit(EXIT_FAILURE);
+	}
+
+	return (int64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* See clock.h */
+struct timeval
+nstotv(int64_t ns)
+{
+	struct timeval tv;
+
+	if (ns < 0) {
+		ns = 0;
+	}
+
+	/* round up, so that a wait is never cut short */
+	ns += NS_PER_US - 1;
+
+	tv.tv_sec  = ns / NS_PER_SEC;
+	tv.tv_usec = ns % NS_PER_SEC / NS_PER_US;
+
+	assert(tv.tv_usec >= 0 && tv.tv_usec < 1000000);
+
+	return tv;
+}
+
+/* See clock.h */
+double
+nstoms(int64_t ns)
+{
+	return ns / (double) NS_PER_MS;
+}
+
+/* See clock.h */
+int64_t
+sectons(double sec)
+{
+	return (int64_t) llround(sec * NS_PER_SEC);
+}
+
@@ -0,0 +1,50 @@
+/*
+ * A monotonic clock in integer nanoseconds, for timing pings.
+ *
+ * The clock is CLOCK_MONOTONIC, and so unaffected by steps to the
+ * time of day. Building with -DUSE_MONOTONIC_RAW selects
+ * CLOCK_MONOTONIC_RAW where available, which is not slewed by NTP either.
+ */
+
+#ifndef DG_CLOCK_H
+#define DG_CLOCK_H
+
+#include <sys/time.h>
+
+#include <stdint.h>
+
+#define NS_PER_US  1000LL
+#define NS_PER_MS  1000000LL
+#define NS_PER_SEC 1000000000LL
+
+/*
+ * The current time, from an arbitrary epoch. This exits on error.
+ */
+int64_t
+clocknow(void);
+
+/*
+ * The time of day, in the same form, for comparison with timestamps taken
+ * by the kernel (see tstamp.h) or by another host. This exits on error.
+ */
+int64_t
+clockreal(void);
+
+/*
+ * Convert a (non-negative) duration for select(); negative durations
+ * become zero.
+ */
+struct timeval
+nstotv(int64_t ns);
+
+/*
+ * Convert to and from floating point, for the user's benefit only.
+ */
+double
+nstoms(int64_t ns);
+
+int64_t
+sectons(double sec);
+
+#endif
+
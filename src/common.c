@@ -5,6 +5,7 @@
 
 #define _GNU_SOURCE
 
+#include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -12,12 +13,15 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <errno.h>
 
 #include "common.h"
+#include "cksum.h"
+#include "clock.h"
+#include "tstamp.h"
 
 #if defined(__GNU_LIBRARY__) || defined(__GLIBC__) || defined(__sun)
 # undef  HAVE_SALEN
@@ -29,22 +33,34 @@
 # define HAVE_SALEN
 #endif
 
+/*
+ * mkping() is called concurrently by stpingd's workers.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+# define THREAD_LOCAL _Thread_local
+#else
+# define THREAD_LOCAL __thread
+#endif
+
 /* TODO strip unneccessary headers from *.c */
 
 /*
- * Calculate the 8-bit Fletcher checksum for a string treated as a
- * sequence of octets. The algorithim is defined in RFC1146 Appendix I:
+ * Calculate the 8-bit Fletcher checksum for len octets. The algorithim is
+ * defined in RFC1146 Appendix I:
  * http://tools.ietf.org/html/rfc1146#appendix-I
+ *
+ * This departs from the RFC in reducing by (a > 8) rather than (a >> 8),
+ * and in returning only a; but it is what is on the wire, and so it stays.
  */
 static uint8_t
-fletcher8(const void *buf)
+fletcher8(const void *buf, size_t len)
 {
 	const uint8_t *d = buf;
 	uint16_t a = 0;
 	uint16_t b = 0;
 	size_t i;
 
-	for(i = 0; i < strlen(buf); i++) {
+	for (i = 0; i < len; i++) {
 		a += d[i];
 		b += a;
 
@@ -55,42 +71,82 @@ fletcher8(const void *buf)
 	return (b << 8) | a;
 }
 
-/*
- * sprintf() prefixed with an eight-bit fletcher checksum.
- * Requires two bytes to prefix the checkum as hex.
- */
+/* n hex digits of v, most significant first, without a '\0' */
+static void
+puthex(char *p, uint64_t v, unsigned n)
+{
+	static const char digit[] = "0123456789ABCDEF";
+
+	while (n-- > 0) {
+		p[n] = digit[v & 0xf];
+		v >>= 4;
+	}
+}
+
+/* parse exactly n hex digits; returns 0 if any is not a hex digit */
 static int
-ckvsprintf(char *buf, const char *fmt, ...)
+gethex(const char *p, unsigned n, uint64_t *v)
 {
-	int n;
+	uint64_t x;
+	unsigned i;
 
-	/* Format string */
-	{
-		va_list ap;
+	x = 0;
 
-		va_start(ap, fmt);
-		n = vsprintf(buf + 2, fmt, ap);
-		va_end(ap);
-	}
+	for (i = 0; i < n; i++) {
+		unsigned c;
 
-	/* Prepend checksum */
-	{
-		uint8_t cksum;
-		char c = buf[2];
+		c = (unsigned char) p[i];
+
+		if (c >= '0' && c <= '9') {
+			c -= '0';
+		} else if (c >= 'A' && c <= 'F') {
+			c -= 'A' - 10;
+		} else if (c >= 'a' && c <= 'f') {
+			c -= 'a' - 10;
+		} else {
+			return 0;
+		}
 
-		cksum = fletcher8(buf + 2);
-		sprintf(buf, "%02X", cksum);
-		buf[2] = c;
+		x = (x << 4) | c;
 	}
 
-	return n + 2;
+	*v = x;
+
+	return 1;
 }
 
+/*
+ * Fill in the sequence number around the 24 characters already at buf + 8,
+ * and prefix the checksum, in the form:
+ *
+ *   "CK SEQQ <24 characters>\n"
+ */
+static const char *
+ckfill(char *buf, uint16_t seq)
+{
+	buf[2] = ' ';
+	puthex(buf + 3, seq, 4);
+	buf[7] = ' ';
+	buf[PING_LEN - 1] = '\n';
+	buf[PING_LEN] = '\0';
+
+	/* the checksum is over everything after itself */
+	puthex(buf, fletcher8(buf + 2, PING_LEN - 2), 2);
+
+	return buf;
+}
+
+/* shared by mkping() and mkstamped() */
+static THREAD_LOCAL char pingbuf[PING_LEN + 1];
+
+/* the time of day for humans, as of pingsec; see mkping() */
+static THREAD_LOCAL char pingtime[24];
+static THREAD_LOCAL time_t pingsec;
+
 /* See common.h */
 const char *
 mkping(uint16_t seq)
 {
-	static char buf[3 + 5 + 24 + 2];
 	time_t t;
 
 	t = time(NULL);
@@ -101,32 +157,130 @@ mkping(uint16_t seq)
 
 	/*
 	 * The time formatted here is not actually used; it is for human reference
-	 * only.
+	 * only. It changes once a second at most, and so is formatted only then.
 	 *
 	 * TODO mention fletcher needs a few bytes for entropy?
 	 */
 	/* TODO: strftime %z */
-	ckvsprintf(buf, " %04X %.24s\n", seq, ctime(&t));
+	if (t != pingsec) {
+		char tbuf[26];
 
-	return buf;
+		if (NULL == ctime_r(&t, tbuf)) {
+			perror("ctime_r");
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy(pingtime, tbuf, sizeof pingtime);
+		pingsec = t;
+	}
+
+	memcpy(pingbuf + 8, pingtime, sizeof pingtime);
+
+	return ckfill(pingbuf, seq);
+}
+
+/* See common.h */
+const char *
+mkstamped(uint16_t seq, int64_t a, int64_t b)
+{
+	/* 12 hex digits apiece, in the 24 characters taken by ctime() */
+	puthex(pingbuf +  8, a & STAMP_MASK, 12);
+	puthex(pingbuf + 20, b & STAMP_MASK, 12);
+
+	return ckfill(pingbuf, seq);
+}
+
+/* See common.h */
+int
+getstamps(const char *in, int64_t *a, int64_t *b)
+{
+	uint64_t x, y;
+
+	assert(in != NULL);
+	assert(a != NULL);
+	assert(b != NULL);
+
+	if (strlen(in) != PING_LEN) {
+		return 0;
+	}
+
+	/* ctime() always has a space after the day of the week */
+	if (!gethex(in + 8, 12, &x) || !gethex(in + 20, 12, &y)) {
+		return 0;
+	}
+
+	*a = (int64_t) x;
+	*b = (int64_t) y;
+
+	return 1;
+}
+
+/* See common.h */
+int64_t
+stampdiff(int64_t later, int64_t earlier)
+{
+	int64_t d;
+
+	d = (later - earlier) & STAMP_MASK;
+
+	/* the nearer of the two ways round */
+	if (d > STAMP_MASK / 2) {
+		d -= STAMP_MASK + 1;
+	}
+
+	return d;
+}
+
+/* See common.h */
+int64_t
+stamprx(const char *in, int64_t kts)
+{
+	int64_t a, b;
+
+	if (!getstamps(in, &a, &b) || b != 0) {
+		return 0;
+	}
+
+	return kts != 0 ? kts : clockreal();
+}
+
+/* See common.h */
+const char *
+mkreply(uint16_t seq, int64_t rx)
+{
+	if (rx == 0) {
+		return mkping(seq);
+	}
+
+	/* as late as we can, short of the kernel's transmit timestamp */
+	return mkstamped(seq, rx, clockreal());
 }
 
 /* See common.h */
 int
 validate(const char *in, uint16_t *seq)
 {
-	unsigned int tck;
-	unsigned int n;
+	uint64_t tck;
+	uint64_t n;
 	uint8_t ock;
+	size_t len;
+
+	assert(in != NULL);
+	assert(seq != NULL);
+
+	len = strlen(in);
 
-	if (2 != sscanf(in, "%02X %04X ", &tck, &n)) {
+	/* "CK SEQQ " */
+	if (len < 8 || in[2] != ' ' || in[7] != ' '
+		|| !gethex(in, 2, &tck) || !gethex(in + 3, 4, &n))
+	{
 		fprintf(stderr, "disregarding: unrecognised format\n");
 		return 0;
 	}
 
-	ock = fletcher8(in + 2);
+	ock = fletcher8(in + 2, len - 2);
 	if (ock != tck) {
-		fprintf(stderr, "disregarding: checksum mismatch: %X != %X\n", ock, tck);
+		fprintf(stderr, "disregarding: checksum mismatch: %X != %X\n", ock, (unsigned) tck);
 		return 0;
 	}
 
@@ -134,6 +288,560 @@ validate(const char *in, uint16_t *seq)
 	return 1;
 }
 
+/* big-endian fields at fixed offsets, for version 2; see common.h */
+static void
+put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >>  8;
+	p[3] = v;
+}
+
+static void
+put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+	     | (uint32_t) p[2] <<  8 | (uint32_t) p[3];
+}
+
+static uint64_t
+get64(const uint8_t *p)
+{
+	return (uint64_t) get32(p) << 32 | get32(p + 4);
+}
+
+/*
+ * The checksum of a version 2 message, taking its cksum field as 0.
+ * This is Fletcher-32 unless the message asks for CRC-32C.
+ */
+static uint32_t
+cksum2(const uint8_t *buf, size_t n)
+{
+	static const uint8_t zero[4];
+	uint32_t crc;
+	struct f32 f;
+
+	assert(n >= PING2_LEN);
+
+	if (buf[3] & PING2_CRC32C) {
+		crc = crc32c(0, buf, 44);
+		crc = crc32c(crc, zero, sizeof zero);
+		crc = crc32c(crc, buf + PING2_LEN, n - PING2_LEN);
+
+		return crc;
+	}
+
+	memset(&f, 0, sizeof f);
+
+	f32add(&f, buf, 44);
+	f32add(&f, zero, sizeof zero);
+	f32add(&f, buf + PING2_LEN, n - PING2_LEN);
+
+	return f32sum(&f);
+}
+
+/* See common.h */
+int
+isping2(const void *buf, size_t n)
+{
+	assert(buf != NULL);
+
+	return n > 0 && * (const uint8_t *) buf == PING2_MAGIC >> 8;
+}
+
+/* See common.h */
+size_t
+mkping2(void *buf, const struct ping2 *p)
+{
+	uint8_t *b = buf;
+
+	assert(buf != NULL);
+	assert(p != NULL);
+
+	b[0] = PING2_MAGIC >> 8;
+	b[1] = PING2_MAGIC & 0xff;
+	b[2] = PING2_VERSION;
+	b[3] = p->flags;
+	put32(b +  4, p->session);
+	put64(b +  8, p->seq);
+	put64(b + 16, p->tx);
+	put64(b + 24, p->srx);
+	put64(b + 32, p->stx);
+	put32(b + 40, p->len);
+	put32(b + 44, cksum2(b, PING2_LEN + p->len));
+
+	return PING2_LEN + p->len;
+}
+
+/* See common.h */
+int
+getping2(const void *buf, size_t n, struct ping2 *p)
+{
+	const uint8_t *b = buf;
+	uint32_t tck, ock;
+
+	assert(buf != NULL);
+	assert(p != NULL);
+
+	if (n < PING2_LEN || b[0] != PING2_MAGIC >> 8 || b[1] != (PING2_MAGIC & 0xff)) {
+		fprintf(stderr, "disregarding: unrecognised format\n");
+		return 0;
+	}
+
+	if (b[2] != PING2_VERSION) {
+		fprintf(stderr, "disregarding: unsupported version %u\n", (unsigned) b[2]);
+		return 0;
+	}
+
+	p->flags   = b[3];
+	p->session = get32(b +  4);
+	p->seq     = get64(b +  8);
+	p->tx      = get64(b + 16);
+	p->srx     = get64(b + 24);
+	p->stx     = get64(b + 32);
+	p->len     = get32(b + 40);
+
+	if (p->len != n - PING2_LEN) {
+		fprintf(stderr, "disregarding: length mismatch: %lu != %lu\n",
+			(unsigned long) p->len, (unsigned long) (n - PING2_LEN));
+		return 0;
+	}
+
+	tck = get32(b + 44);
+	ock = cksum2(b, n);
+	if (ock != tck) {
+		fprintf(stderr, "disregarding: checksum mismatch: %lX != %lX\n",
+			(unsigned long) ock, (unsigned long) tck);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* See common.h */
+void
+reply2(void *buf, size_t n, int64_t kts, struct ping2 *p)
+{
+	assert(buf != NULL);
+	assert(p != NULL);
+	assert(n == PING2_LEN + p->len);
+
+	/* capabilities we do not know of are refused */
+	p->flags &= PING2_STAMPS | PING2_CRC32C;
+
+	if (p->flags & PING2_STAMPS) {
+		p->srx = kts != 0 ? kts : clockreal();
+		p->stx = clockreal();
+	}
+
+	(void) mkping2(buf, p);
+}
+
+/*
+ * xorshift64*, which gives 8 bytes per step; the state is never 0.
+ */
+static uint64_t
+xsnext(uint64_t *x)
+{
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+
+	return *x * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+static uint64_t
+xsseed(uint64_t seed)
+{
+	/* splitmix64's finaliser, so that adjacent seeds give unrelated streams */
+	seed += UINT64_C(0x9E3779B97F4A7C15);
+	seed = (seed ^ (seed >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	seed = (seed ^ (seed >> 27)) * UINT64_C(0x94D049BB133111EB);
+	seed ^= seed >> 31;
+
+	return seed != 0 ? seed : 1;
+}
+
+/* See common.h */
+void
+mkpayload(void *buf, size_t len, uint64_t seed)
+{
+	uint8_t *b = buf;
+	uint64_t x, v;
+	size_t i;
+
+	assert(buf != NULL || len == 0);
+
+	x = xsseed(seed);
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		v = xsnext(&x);
+		memcpy(b + i, &v, sizeof v);
+	}
+
+	if (i < len) {
+		v = xsnext(&x);
+		memcpy(b + i, &v, len - i);
+	}
+}
+
+/* See common.h */
+void
+mkecho(void *buf, const struct echo *e)
+{
+	uint8_t *b = buf;
+
+	assert(buf != NULL);
+	assert(e != NULL);
+
+	put64(b +  0, e->due);
+	put64(b +  8, e->wtx);
+	put64(b + 16, e->nonce);
+}
+
+/* See common.h */
+void
+getecho(const void *buf, struct echo *e)
+{
+	const uint8_t *b = buf;
+
+	assert(buf != NULL);
+	assert(e != NULL);
+
+	e->due   = get64(b +  0);
+	e->wtx   = get64(b +  8);
+	e->nonce = get64(b + 16);
+}
+
+/* See common.h */
+uint64_t
+echononce(uint64_t key, uint64_t seq, int64_t tx, const struct echo *e)
+{
+	uint64_t h;
+
+	assert(e != NULL);
+
+	h = xsseed(key ^ seq);
+	h = xsseed(h ^ (uint64_t) tx);
+	h = xsseed(h ^ (uint64_t) e->due);
+	h = xsseed(h ^ (uint64_t) e->wtx);
+
+	return h;
+}
+
+/* See common.h */
+int
+checkpayload(const void *buf, size_t len, uint64_t seed)
+{
+	const uint8_t *b = buf;
+	uint64_t x, v;
+	size_t i;
+
+	assert(buf != NULL || len == 0);
+
+	x = xsseed(seed);
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		v = xsnext(&x);
+		if (0 != memcmp(b + i, &v, sizeof v)) {
+			return 0;
+		}
+	}
+
+	if (i < len) {
+		v = xsnext(&x);
+		if (0 != memcmp(b + i, &v, len - i)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* See common.h */
+void
+rxinit(struct rxbuf *rx, char *buf, size_t size)
+{
+	assert(rx != NULL);
+	assert(size >= PING2_LEN);
+
+	rx->buf     = buf;
+	rx->size    = buf != NULL ? size : 0;
+	rx->inl     = buf;
+	rx->inlsize = size;
+	rx->lazy    = buf == NULL;
+	rx->start   = 0;
+	rx->end     = 0;
+	rx->skip    = 0;
+	rx->owned   = 0;
+	rx->kts     = 0;
+}
+
+/* See common.h */
+void
+rxfini(struct rxbuf *rx)
+{
+	assert(rx != NULL);
+
+	if (rx->owned) {
+		free(rx->buf);
+	}
+
+	if (rx->lazy) {
+		free(rx->inl);
+		rx->inl = NULL;
+	}
+
+	rx->buf   = NULL;
+	rx->size  = 0;
+	rx->owned = 0;
+}
+
+/*
+ * Allocate the buffer deferred by rxinit(), if not yet done.
+ * Returns -1 on error.
+ */
+static int
+rxalloc(struct rxbuf *rx)
+{
+	assert(rx != NULL);
+
+	if (rx->buf != NULL) {
+		return 0;
+	}
+
+	assert(rx->lazy);
+
+	rx->inl = malloc(rx->inlsize);
+	if (rx->inl == NULL) {
+		return -1;
+	}
+
+	rx->buf  = rx->inl;
+	rx->size = rx->inlsize;
+
+	return 0;
+}
+
+/*
+ * The length of the message starting at p, of which n bytes are held,
+ * or 0 if that is not yet known. A message too long to hold is given as
+ * SIZE_MAX where its length does not fit in a size_t, and so the rest of
+ * the stream is skipped.
+ */
+static size_t
+rxneed(const char *p, size_t n)
+{
+	uint32_t len;
+
+	if (!isping2(p, n)) {
+		return PING_LEN;
+	}
+
+	if (n < PING2_LEN) {
+		return 0;
+	}
+
+	len = get32((const uint8_t *) p + 40);
+
+	/* too long to hold; bounded before adding, since size_t may be 32 bits */
+#if SIZE_MAX - PING2_LEN < UINT32_MAX
+	if (len > STREAM_MAXLEN - PING2_LEN && len > SIZE_MAX - PING2_LEN) {
+		return SIZE_MAX;
+	}
+#endif
+
+	/* added as size_t, since the sum overflows a uint32_t */
+	return PING2_LEN + (size_t) len;
+}
+
+/*
+ * Move what is held so far to a buffer of the given size, so that a long
+ * message fits. Returns -1 on error.
+ */
+static int
+rxgrow(struct rxbuf *rx, size_t size)
+{
+	char *new;
+
+	assert(rx != NULL);
+	assert(size > rx->size);
+
+	new = malloc(size);
+	if (new == NULL) {
+		return -1;
+	}
+
+	memcpy(new, rx->buf + rx->start, rx->end - rx->start);
+
+	if (rx->owned) {
+		free(rx->buf);
+	}
+
+	rx->buf   = new;
+	rx->size  = size;
+	rx->end  -= rx->start;
+	rx->start = 0;
+	rx->owned = 1;
+
+	return 0;
+}
+
+/*
+ * Return to the buffer given, once the long message has been taken and
+ * what follows fits, so that a long message costs memory only while held.
+ */
+static void
+rxshrink(struct rxbuf *rx)
+{
+	size_t n;
+
+	assert(rx != NULL);
+
+	n = rx->end - rx->start;
+
+	if (!rx->owned || n > rx->inlsize || rxneed(rx->buf + rx->start, n) > rx->inlsize) {
+		return;
+	}
+
+	memcpy(rx->inl, rx->buf + rx->start, n);
+	free(rx->buf);
+
+	rx->buf   = rx->inl;
+	rx->size  = rx->inlsize;
+	rx->start = 0;
+	rx->end   = n;
+	rx->owned = 0;
+}
+
+static void
+rxcompact(struct rxbuf *rx)
+{
+	assert(rx != NULL);
+	assert(rx->start <= rx->end);
+
+	/* move any partial message to the front */
+	if (rx->start > 0) {
+		memmove(rx->buf, rx->buf + rx->start, rx->end - rx->start);
+		rx->end  -= rx->start;
+		rx->start = 0;
+	}
+}
+
+/* See common.h */
+ssize_t
+rxfill(int s, struct rxbuf *rx, int flags)
+{
+	ssize_t r;
+
+	assert(rx != NULL);
+
+	if (-1 == rxalloc(rx)) {
+		return -1;
+	}
+
+	rxcompact(rx);
+
+	if (rx->end == rx->size) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	r = tsrecv(s, rx->buf + rx->end, rx->size - rx->end, flags, NULL, NULL, &rx->kts);
+	if (r > 0) {
+		rx->end += r;
+	}
+
+	return r;
+}
+
+/* See common.h */
+size_t
+rxput(struct rxbuf *rx, const void *p, size_t n)
+{
+	assert(rx != NULL);
+	assert(p != NULL);
+
+	if (-1 == rxalloc(rx)) {
+		perror("malloc");
+		return 0;
+	}
+
+	rxcompact(rx);
+
+	if (n > rx->size - rx->end) {
+		n = rx->size - rx->end;
+	}
+
+	memcpy(rx->buf + rx->end, p, n);
+	rx->end += n;
+
+	return n;
+}
+
+/* See common.h */
+char *
+rxframe(struct rxbuf *rx, size_t *len)
+{
+	char *p;
+	size_t n, need;
+
+	assert(rx != NULL);
+	assert(len != NULL);
+
+	/* nothing has been received yet, into a buffer deferred by rxinit() */
+	if (rx->buf == NULL) {
+		return NULL;
+	}
+
+	/* the remainder of a message too long to hold */
+	n = rx->end - rx->start < rx->skip ? rx->end - rx->start : rx->skip;
+	rx->start += n;
+	rx->skip  -= n;
+
+	/* the message last returned is done with */
+	rxshrink(rx);
+
+	p = rx->buf + rx->start;
+	n = rx->end - rx->start;
+
+	need = rxneed(p, n);
+	if (need == 0) {
+		return NULL;
+	}
+
+	if (need > rx->size && need <= STREAM_MAXLEN && -1 == rxgrow(rx, need)) {
+		perror("malloc");
+	}
+
+	/* this can never be complete, and so is discarded as it arrives */
+	if (need > rx->size) {
+		rx->skip  = need - n;
+		rx->start = rx->end;
+		return NULL;
+	}
+
+	p = rx->buf + rx->start;
+
+	if (n < need) {
+		return NULL;
+	}
+
+	*len = need;
+
+	rx->start += need;
+
+	return p;
+}
+
 /* See common.h */
 int
 getaddr(const char *addr, const char *port, struct sockaddr_in *sin,
@@ -5,15 +5,242 @@
 #ifndef DG_COMMON_H
 #define DG_COMMON_H
 
+#include <sys/types.h>
+
+#include <stddef.h>
 #include <stdint.h>
 
+/*
+ * The length of a ping message on the wire, excluding the '\0' terminator
+ * (which is sent for SOCK_DGRAM only).
+ */
+#define PING_LEN (2 + 1 + 4 + 1 + 24 + 1)
+
+/*
+ * The longest messages: a UDP datagram over IPv4, and on a stream,
+ * a limit on how much a peer may have us hold at once.
+ */
+#define DGRAM_MAXLEN  65507
+#define STREAM_MAXLEN (1 << 20)
+
+/*
+ * Version 2 messages are binary, with a fixed header in network byte order
+ * which is decoded by plain loads at fixed offsets:
+ *
+ *   offset  size  field
+ *        0     2  magic, PING2_MAGIC; its first byte is never a hex digit,
+ *                 and so never the start of a version 1 message
+ *        2     1  version, PING2_VERSION
+ *        3     1  flags, PING2_*
+ *        4     4  session, chosen by the client
+ *        8     8  seq
+ *       16     8  tx, the client's send time, by its own clock
+ *       24     8  srx, the daemon's receive time (of day), or 0
+ *       32     8  stx, the daemon's send time (of day), or 0
+ *       40     4  len, the length of the payload following the header
+ *       44     4  cksum, Fletcher-32 over the header (with cksum 0) and payload,
+ *                 or CRC-32C with PING2_CRC32C; see cksum.h
+ *
+ * Daemons tell the versions apart per message, and answer each in kind,
+ * so that clients of either version may share a daemon. Flags are the
+ * capabilities a client asks for; a daemon clears those it does not know
+ * from its reply, and the payload and every field but srx, stx and cksum
+ * are echoed unchanged. The checksum flag is an exception: a daemon which
+ * does not know it cannot check the request, and so disregards it.
+ */
+#define PING2_MAGIC   0xD750
+#define PING2_VERSION 2
+#define PING2_LEN     48
+
+#define PING2_STAMPS  (1 << 0) /* asks for srx and stx */
+#define PING2_CRC32C  (1 << 1) /* cksum is CRC-32C, for the request and reply */
+
+struct ping2 {
+	uint8_t flags;
+	uint32_t session;
+	uint64_t seq;
+	int64_t tx;
+	int64_t srx;
+	int64_t stx;
+	uint32_t len;
+};
+
+/*
+ * True if the n bytes at buf start as a version 2 message would.
+ * This looks at the first byte only, so n may be short of a header.
+ */
+int
+isping2(const void *buf, size_t n);
+
+/*
+ * Write the header for p to buf, and checksum it along with the p->len
+ * bytes of payload which must already follow it. Returns the length of
+ * the whole message.
+ */
+size_t
+mkping2(void *buf, const struct ping2 *p);
+
+/*
+ * Decode a version 2 message of n bytes. Returns 1 if it is valid.
+ */
+int
+getping2(const void *buf, size_t n, struct ping2 *p);
+
+/*
+ * For daemons: turn a version 2 message of n bytes, as decoded to *p by
+ * getping2(), into its reply in place, with timestamps (if asked for)
+ * given the kernel's receive time kts, or 0. *p is updated to match.
+ */
+void
+reply2(void *buf, size_t n, int64_t kts, struct ping2 *p);
+
+/*
+ * For clients: a payload of len pseudo-random bytes, given by seed.
+ * A reply's payload is checked by generating it again, so that nothing
+ * need be kept per ping; checkpayload() returns 1 if it matches.
+ */
+void
+mkpayload(void *buf, size_t len, uint64_t seed);
+
+int
+checkpayload(const void *buf, size_t len, uint64_t seed);
+
+/*
+ * For clients: what a version 2 ping carries at the start of its payload,
+ * for its reply to be dealt with without keeping anything per ping.
+ * The send time is the header's tx, which is echoed too.
+ */
+#define ECHO_LEN 24
+
+struct echo {
+	int64_t due;    /* when the ping was scheduled to be sent */
+	int64_t wtx;    /* sent by the time of day, or 0 */
+	uint64_t nonce; /* from echononce() */
+};
+
+void
+mkecho(void *buf, const struct echo *e);
+
+void
+getecho(const void *buf, struct echo *e);
+
+/*
+ * A hash of a ping's seq and tx and the other fields of *e, under a key
+ * chosen by the client, so that a reply is checked to carry them as sent.
+ * This is no defence against a peer which has seen other nonces.
+ */
+uint64_t
+echononce(uint64_t key, uint64_t seq, int64_t tx, const struct echo *e);
+
+/*
+ * Reassembly for a stream of messages. Each recv() takes everything
+ * available which fits, and rxframe() then splits out complete messages.
+ *
+ * A message longer than the buffer given is held in one allocated to fit,
+ * up to STREAM_MAXLEN; longer messages are discarded. The buffer given is
+ * returned to once what remains fits in it again.
+ */
+struct rxbuf {
+	char *buf;
+	size_t size;
+	char *inl;   /* the buffer given to rxinit(), or allocated for it */
+	size_t inlsize;
+	int lazy;    /* inl is allocated on first use, and freed by rxfini() */
+	size_t start;
+	size_t end;
+	size_t skip; /* of a message too long to hold, yet to be received */
+	int owned;   /* buf was allocated by rxframe() */
+	int64_t kts; /* kernel timestamp for the last rxfill(), if any; see tstamp.h */
+};
+
+/*
+ * If buf is NULL, a buffer of the given size is allocated on the first
+ * rxfill() or rxput(), so that a peer which sends nothing costs nothing.
+ */
+void
+rxinit(struct rxbuf *rx, char *buf, size_t size);
+
+/*
+ * Free any buffer allocated for a long message, or by rxinit().
+ */
+void
+rxfini(struct rxbuf *rx);
+
+/*
+ * recv() as much as will fit. Returns as for recv(), with -1 and EAGAIN
+ * if there is no room because no complete message has been taken.
+ */
+ssize_t
+rxfill(int s, struct rxbuf *rx, int flags);
+
+/*
+ * Append bytes received by some other means. Returns the number of bytes
+ * taken, which is less than n if there is no room for the remainder.
+ */
+size_t
+rxput(struct rxbuf *rx, const void *p, size_t n);
+
+/*
+ * Return the next complete message of either version, of length *len,
+ * or NULL if none. The message remains valid until the next call to
+ * rxframe(), rxfill() or rxput(), and may be modified in place.
+ */
+char *
+rxframe(struct rxbuf *rx, size_t *len);
+
 /*
  * Format a string to the given sequence number. A pointer to a static
- * string is returned.
+ * string is returned; this is per-thread.
  */
 const char *
 mkping(uint16_t seq);
 
+/*
+ * Timestamps may be carried in place of the time of day for humans. Each is
+ * in nanoseconds of the time of day, kept modulo 2^48 (a little over three
+ * days) to fit, and so only differences between them are meaningful.
+ *
+ * A client asks for timestamps by sending its own transmit time as a,
+ * and 0 as b. The daemon answers with its receive time as a, and the
+ * time it sent the reply as b.
+ */
+#define STAMP_MASK ((INT64_C(1) << 48) - 1)
+
+/*
+ * As mkping(), carrying timestamps a and b. The string is per-thread,
+ * and shared with mkping().
+ */
+const char *
+mkstamped(uint16_t seq, int64_t a, int64_t b);
+
+/*
+ * Parse the timestamps from a validated message. Returns 0 if it carries
+ * the time of day instead.
+ */
+int
+getstamps(const char *in, int64_t *a, int64_t *b);
+
+/*
+ * The signed difference later - earlier between two timestamps.
+ */
+int64_t
+stampdiff(int64_t later, int64_t earlier);
+
+/*
+ * For daemons: if the message asks for timestamps, the time it was received,
+ * being kts where the kernel gave one (see tstamp.h), or else now.
+ * Otherwise 0.
+ */
+int64_t
+stamprx(const char *in, int64_t kts);
+
+/*
+ * For daemons: the reply to seq, carrying timestamps if rx is non-zero,
+ * as given by stamprx(). The string is as for mkping().
+ */
+const char *
+mkreply(uint16_t seq, int64_t rx);
+
 /*
  * Validate an expected checksum. Return true on success.
  */
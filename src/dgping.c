@@ -6,8 +6,8 @@
  * - Out of order responses
  * - Duplicate packets
  *
- * Pending responses are stored in a simple linked list; these are removed
- * either when a response is received, or on timeout. A checksum is included
+ * Pending responses are stored in a table indexed by sequence number; these
+ * are removed either when a response is received, or on timeout. A checksum is included
  * in the packet contents to detect corruption, and a sequence number is used
  * to identify the order of responses.
  *
@@ -23,14 +23,11 @@
  * TODO: gethostbyname for argv[1]
  * TODO: any other syscalls for EINTR?
  * TODO: select can't predict the future. consider making everything non-blocking
- * TODO: i am ever suspicious about timing; confirm lengths are ok for select() loop.
  * TODO: make timeout configurable
  * TODO: add "don't fragment" option
- * TODO: add packet size option, filled with random data, for stress testing. checksum this, too.
  * TODO: option to dump packet contents, tcpdump style, for visualisation.
  * TODO: don't use stdint.h!
  * TODO: keep going if IP vanishes (e.g. by DHCP); i.e. send() fails
- * TODO: i think the timing is wrong after handling a signal (e.g. SIGINFO)
  * TODO: print the number which are pending in the stats
  */
 
@@ -61,6 +58,14 @@
 #include <signal.h>
 
 #include "common.h"
+#include "clock.h"
+#include "tstamp.h"
+#include "busy.h"
+#include "schedule.h"
+#include "hist.h"
+#include "capture.h"
+#include "pending.h"
+#include "seen.h"
 
 /*
  * Workaround for inline assembly in glibc confusing MSan
@@ -82,11 +87,11 @@
 
 /*
  * The time to timeout pending responses, and the time between pings.
- * Both times are given in milliseconds. Culltime (given in seconds)
+ * Both times are given in nanoseconds. Culltime (given in seconds)
  * is the length of time to wait for unanswered pings.
  */
-#define TIMEOUT  5.0 * 1000.0
-#define INTERVAL 0.5 * 1000.0
+#define TIMEOUT  (5000 * NS_PER_MS)
+#define INTERVAL ( 500 * NS_PER_MS)
 #define CULLTIME 6
 
 /* Variables for logging statistics */
@@ -95,25 +100,90 @@ unsigned int stat_recieved;
 unsigned int stat_timedout;
 unsigned int stat_ignored;
 
-double stat_timemax;
-double stat_timemin = DBL_MAX;
-double stat_timesum;
-double stat_timesqr;
-
-/* flags for signal handlers */
-volatile sig_atomic_t shouldexit;
-volatile sig_atomic_t shouldinfo;
-
+/* The full sequence number of the next ping, which unlike stat_sent never wraps */
+uint64_t nextseq;
+
+/* Round-trip times, in ns; see hist.h */
+struct hist stat_rtt;
+
+/* Kernel-level round-trip times, for -k */
+unsigned int stat_kcount;
+double stat_ktimemax;
+double stat_ktimemin = DBL_MAX;
+double stat_ktimesum;
+
+/* -k: kernel timestamps, and the sequence number for each datagram sent */
+int ktimes;
+uint16_t txseq[PENDING_SLOTS];
+uint32_t txcount;
+
+/* The time between pings, and when to send them */
+int64_t interval = INTERVAL;
+struct schedule sched;
+
+/* Round-trip times from when each ping was due, rather than sent */
+double stat_stimemax;
+double stat_stimemin = DBL_MAX;
+double stat_stimesum;
+
+/* When pinging began, for the times of -I reports */
+int64_t stat_start;
+
+/* When the first and latest pings were sent, for the rate achieved */
+int64_t stat_first;
+int64_t stat_last;
+
+/* Server dwell times, for -d */
+unsigned int stat_dcount;
+double stat_dtimemax;
+double stat_dtimemin = DBL_MAX;
+double stat_dtimesum;
+
+/* -I: the time between reports, and statistics for the current report window */
+int64_t report;
+struct {
+	int64_t start;
+	int64_t end;
+	unsigned int sent;
+	unsigned int recieved;
+	unsigned int timedout;
+	unsigned int ignored;
+	struct hist rtt;
+} win;
+
+/* -w: the capture file, or NULL; see capture.h */
+FILE *capf;
+
+/* -2: send version 2 messages, tagged with this session; see common.h */
+int proto2;
+uint32_t session;
+
+/* -s: bytes of pseudo-random payload carried by each version 2 message */
+size_t payload;
+
+/* -C: checksum version 2 messages by CRC-32C, rather than Fletcher-32 */
+int crc;
 
 /*
- * A linked-list of unanswered ping requests.
+ * -e: take what is known of each ping from its reply, which echoes it,
+ * keeping just a bit per ping rather than a struct pending; see seen.h.
+ * The key is for each ping's nonce.
  */
-struct pending {
-	struct timeval t;
-	uint16_t seq;
+int echoed;
+uint64_t key;
+struct seentab seen;
+
+/* -d: ask the daemon for its timestamps */
+int stamps;
 
-	struct pending *next;
-};
+/* -b: spin on receive; -a, -f: CPU and SCHED_FIFO priority */
+int busy;
+int cpu = -1;
+int prio;
+
+/* flags for signal handlers */
+volatile sig_atomic_t shouldexit;
+volatile sig_atomic_t shouldinfo;
 
 static void
 sighandler(int s)
@@ -136,62 +206,114 @@ sighandler(int s)
 }
 
 /*
- * Calculate the difference a given time and the current time; a - b.
+ * For -w, record a ping resolved, or a reply which could not be matched
+ * to one, in which case p is NULL. A version 2 ping's full sequence number
+ * is its count sent, so seq is needed in full only where p is NULL.
  */
-static struct timeval
-xtimersub(struct timeval *a, struct timeval *b)
+static void
+capture(const struct pending *p, uint64_t seq, int64_t recv, size_t size,
+	enum capstatus status)
 {
-	struct timeval t;
+	struct caprec r;
 
-	t.tv_sec  = a->tv_sec  - b->tv_sec;
-	t.tv_usec = a->tv_usec - b->tv_usec;
-
-	if (t.tv_usec < 0) {
-		t.tv_sec--;
-		t.tv_usec += 1000 * 1000;
+	if (capf == NULL) {
+		return;
 	}
 
-	return t;
+	memset(&r, 0, sizeof r);
+	r.sent   = p != NULL ? p->t : 0;
+	r.n      = p != NULL ? p->n : 0;
+	r.recv   = recv;
+	r.seq    = proto2 && p != NULL ? p->n : seq;
+	r.size   = size;
+	r.status = status;
+
+	if (-1 == capwrite(capf, &r)) {
+		perror("capture");
+		exit(EXIT_FAILURE);
+	}
 }
 
 /*
- * Check validity of a timeval structure, adjusting it if necessary. This is
- * provided for convenience of inaccurate arithmetic around the limits of
- * floating point calculations, to permit ping internals at fractions of a
- * second without unnecessarily complex.error-checking around select().
- *
- * Since negative values in this program are only ever produced by floating
- * point inaccuracies, they will always be small (to the order of epsilon or
- * so), and hence are just set to 0, if present.
- *
- * See SUS3 <sys/types.h>'s specification for a discussion of valid values here.
+ * For -e, give up on pings as seenexpire() says. Only their number is
+ * known, and so nothing else is reported.
  */
 static void
-xitimerfix(struct timeval *tv)
+cullseen(int64_t now)
 {
-	assert(tv->tv_usec <= 1000000);
+	struct pending gone;
+	uint64_t n;
 
-	if (tv->tv_sec < 0) {
-		tv->tv_sec = 0;
-	}
+	while (seenexpire(&seen, now, &n)) {
+		stat_timedout++;
+		win.timedout++;
+		printf("timeout: seq=%d\n", (int) (uint16_t) n);
 
-	if (tv->tv_usec < 0) {
-		tv->tv_usec = 0;
+		memset(&gone, 0, sizeof gone);
+		gone.n = n;
+		capture(&gone, n, now, 0, CAP_TIMEOUT);
 	}
 }
 
 static void
-sendecho(int s, struct pending **p, uint16_t seq)
+sendecho(int s, struct pendtab *pt, uint16_t seq, int64_t due)
 {
+	static char msg[DGRAM_MAXLEN];
 	const char *buf;
-	struct pending *new;
+	int64_t t, w;
+	size_t len;
+
+	w = stamps ? clockreal() : 0;
+
+	/* before send(), which may not return until after the reply has come */
+	t = clocknow();
+
+	if (proto2) {
+		struct ping2 p;
+
+		/* seq is cut from the full sequence number */
+		seq = nextseq;
+
+		p.flags   = (stamps ? PING2_STAMPS : 0) | (crc ? PING2_CRC32C : 0);
+		p.session = session;
+		p.seq     = nextseq;
+		p.tx      = t;
+		p.srx     = 0;
+		p.stx     = 0;
+		p.len     = (echoed ? ECHO_LEN : 0) + payload;
+
+		if (echoed) {
+			struct echo e;
+
+			e.due   = due;
+			e.wtx   = w;
+			e.nonce = echononce(key, p.seq, p.tx, &e);
 
-	buf = mkping(seq);
+			mkecho(msg + PING2_LEN, &e);
+		}
+
+		mkpayload(msg + PING2_LEN + p.len - payload, payload, (uint64_t) session << 32 ^ p.seq);
+
+		len = mkping2(msg, &p);
+		buf = msg;
+	} else {
+		buf = stamps ? mkstamped(seq, w, 0) : mkping(seq);
+		len = strlen(buf) + 1;
+	}
 
-	while (-1 == send(s, buf, strlen(buf) + 1, 0)) {
+	/* a ping pushed out of the window is given up on before its number is reused */
+	if (echoed) {
+		cullseen(t);
+	}
+
+	while (-1 == send(s, buf, len, 0)) {
 		switch (errno) {
 		case EINTR:
 		case ENOBUFS:
+		case EAGAIN: /* nonblocking, for -b */
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
 			continue;
 
 		default:
@@ -200,82 +322,186 @@ sendecho(int s, struct pending **p, uint16_t seq)
 		}
 	}
 
+	if (stat_sent == 0) {
+		stat_first = t;
+	}
+	stat_last = t;
+
 	stat_sent++;
+	nextseq++;
+	win.sent++;
 
-	/* Add this request to the list of pings pending responses */
-	new = malloc(sizeof *new);
-	if (NULL == new) {
-		perror("malloc");
-		exit(EXIT_FAILURE);
+	if (echoed) {
+		seenadd(&seen, nextseq - 1, t);
+		return;
 	}
 
-	if (-1 == gettimeofday(&new->t, NULL)) {
-		perror("gettimeofday");
-		exit(EXIT_FAILURE);
+	txseq[txcount++ % PENDING_SLOTS] = seq;
+
+	/* the sequence number has wrapped round to a ping never answered */
+	{
+		struct pending *old;
+
+		old = pendfind(pt, seq);
+		if (old != NULL) {
+			stat_timedout++;
+			win.timedout++;
+			printf("timeout: seq=%d time=%.3f ms\n", seq, nstoms(t - old->t));
+			capture(old, seq, t, 0, CAP_TIMEOUT);
+			pendremove(pt, old);
+		}
 	}
 
-	new->next = *p;
-	new->seq = seq;
+	/* Add this request to the table of pings pending responses */
+	{
+		struct pending *p;
 
-	*p = new;
+		p = pendadd(pt, seq, t);
+		p->wtx = w;
+		p->due = due;
+		p->n   = nextseq - 1;
+	}
 }
 
-static struct pending **
-findpending(uint16_t seq, struct pending **p)
+/*
+ * Note the kernel's transmit timestamps, as they arrive on the error queue.
+ * Datagrams sent are counted from 0, and keyed by that count.
+ */
+static void
+recvtx(int s, struct pendtab *pt)
 {
-	struct pending **curr;
+	uint32_t id;
+	int64_t kts;
 
-	for (curr = p; *curr; curr = &(*curr)->next) {
-		if ((*curr)->seq == seq) {
-			return curr;
+	while (1 == tstx(s, &id, &kts)) {
+		struct pending *p;
+
+		if (kts == 0) {
+			continue;
 		}
-	}
 
-	return NULL;
+		p = pendfind(pt, txseq[id % PENDING_SLOTS]);
+		if (p != NULL) {
+			p->ktx = kts;
+		}
+	}
 }
 
 /*
- * Convert a timeval struct to milliseconds.
+ * Decode a reply of either version. For version 2, *n is the count of pings
+ * sent before the one answered; otherwise it is -1. *a and *b are the
+ * daemon's timestamps, or 0 if it gave none. For -e, *e is filled from what
+ * a version 2 reply echoes. Returns 0 if not valid.
  */
-static double
-tvtoms(struct timeval *tv)
+static int
+decode(const char *buf, size_t len, uint16_t *seq, int64_t *n,
+	int64_t *a, int64_t *b, struct pending *e)
 {
-	return tv->tv_usec / 1000.0 + tv->tv_sec * 1000.0;
-}
+	size_t off;
 
-static struct timeval
-mstotv(double ms) {
-	struct timeval tv;
+	assert(buf != NULL);
+	assert(seq != NULL);
+	assert(n != NULL);
+	assert(a != NULL && b != NULL);
+	assert(e != NULL);
 
-	tv.tv_sec  = round(ms / 1000.0);
-	tv.tv_usec = round(fmod(ms, 1000.0) * 1000.0);
-	return tv;
-}
+	off = echoed ? ECHO_LEN : 0;
 
-static void
-removepending(struct pending **p)
-{
-	struct pending *tmp;
+	if (isping2(buf, len)) {
+		struct ping2 p;
+
+		if (1 != getping2(buf, len, &p)) {
+			return 0;
+		}
 
-	tmp = *p;
-	*p = (*p)->next;
-	free(tmp);
+		if (p.session != session) {
+			fprintf(stderr, "disregarding: session %08lX is not ours\n",
+				(unsigned long) p.session);
+			return 0;
+		}
+
+		if (p.len != off + payload) {
+			fprintf(stderr, "disregarding: payload of %lu bytes, not %lu\n",
+				(unsigned long) p.len, (unsigned long) (off + payload));
+			return 0;
+		}
+
+		/* the checksum shows the reply arrived intact, this that it was echoed */
+		if (!checkpayload(buf + PING2_LEN + off, payload, (uint64_t) session << 32 ^ p.seq)) {
+			fprintf(stderr, "disregarding: payload differs from that sent, seq=%llu\n",
+				(unsigned long long) p.seq);
+			return 0;
+		}
+
+		if (echoed) {
+			struct echo ec;
+
+			getecho(buf + PING2_LEN, &ec);
+
+			if (ec.nonce != echononce(key, p.seq, p.tx, &ec)) {
+				fprintf(stderr, "disregarding: nonce mismatch, seq=%llu\n",
+					(unsigned long long) p.seq);
+				return 0;
+			}
+
+			memset(e, 0, sizeof *e);
+			e->t   = p.tx;
+			e->due = ec.due;
+			e->wtx = ec.wtx;
+			e->n   = p.seq;
+			e->seq = p.seq;
+		}
+
+		*seq = p.seq;
+		*n   = p.seq;
+		*a   = p.srx;
+		*b   = p.stx;
+
+		return 1;
+	}
+
+	if (1 != validate(buf, seq)) {
+		return 0;
+	}
+
+	*n = -1;
+
+	if (!getstamps(buf, a, b)) {
+		*a = 0;
+		*b = 0;
+	}
+
+	return 1;
 }
 
 static void
-recvecho(int s, struct pending **p)
+recvecho(int s, struct pendtab *pt)
 {
-	char buf[3 + 5 + 24 + 2];
+	static char buf[DGRAM_MAXLEN + 1];
    	struct sockaddr_in sin;
-	struct pending **curr;
+	struct pending *curr, got;
 	socklen_t sinsz;
 	uint16_t seq;
+	int64_t n, a, b;
+	int64_t krx;
+	ssize_t len;
+
+	/* the error queue makes the socket readable too */
+	if (ktimes) {
+		recvtx(s, pt);
+	}
 
    	sinsz = sizeof sin;
-	if (-1 == recvfrom(s, buf, sizeof buf, 0, (void *) &sin, &sinsz)) {
+	len = tsrecv(s, buf, sizeof buf - 1, ktimes ? MSG_DONTWAIT : 0,
+		(void *) &sin, &sinsz, &krx);
+	if (len == -1) {
 		switch (errno) {
 		case EINTR:
 		case ENOBUFS:
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
 			return;
 
 		default:
@@ -284,90 +510,232 @@ recvecho(int s, struct pending **p)
 		}
 	}
 
+	/* a version 1 message carries its own '\0', unless truncated */
+	buf[len] = '\0';
+
 	stat_recieved++;
+	win.recieved++;
 
-	if (1 != validate(buf, &seq)) {
+	if (1 != decode(buf, len, &seq, &n, &a, &b, &got)) {
 		stat_ignored++;
+		win.ignored++;
+		capture(NULL, 0, clocknow(), len, CAP_INVALID);
 		return;
 	}
 
-	curr = findpending(seq, p);
+	if (echoed) {
+		/* a version 1 reply cannot be one of ours */
+		switch (n == -1 ? SEEN_STALE : seenreply(&seen, n)) {
+		case SEEN_ANSWERED:
+			curr = &got;
+			break;
+
+		case SEEN_DUPLICATE:
+			fprintf(stderr, "disregarding: duplicate reply, seq=%d\n", seq);
+			stat_ignored++;
+			win.ignored++;
+			capture(NULL, n != -1 ? (uint64_t) n : seq, clocknow(), len, CAP_UNMATCHED);
+			return;
+
+		case SEEN_STALE:
+		default:
+			curr = NULL;
+			break;
+		}
+	} else {
+		/* a version 2 reply may be from a previous time round the table */
+		curr = pendfind(pt, seq);
+		if (curr != NULL && n != -1 && curr->n != (uint64_t) n) {
+			curr = NULL;
+		}
+	}
+
 	if (curr == NULL) {
 		fprintf(stderr, "disregarding: sequence %d not pending response\n", seq);
 		stat_ignored++;
+		win.ignored++;
+		capture(NULL, n != -1 ? (uint64_t) n : seq, clocknow(), len, CAP_UNMATCHED);
 		return;
 	}
 
 	/* Calculate round-trip delta for this particular seq ID */
 	{
-		struct timeval now, dtv;
+		int64_t now, rtt;
 		double d;
 
-		if (-1 == gettimeofday(&now, NULL)) {
-			perror("gettimeofday");
-			exit(EXIT_FAILURE);
+		now = clocknow();
+		rtt = now - curr->t;
+		assert(rtt >= 0);
+
+		d = nstoms(rtt);
+
+		printf("%d bytes from %s seq=%d time=%.3f ms",
+			(int) len, inet_ntoa(sin.sin_addr), seq, d);
+
+		if (krx != 0 && curr->ktx != 0) {
+			double k;
+
+			k = nstoms(krx - curr->ktx);
+
+			printf(" ktime=%.3f ms", k);
+
+			stat_kcount++;
+			stat_ktimesum += k;
+			if (k < stat_ktimemin) {
+				stat_ktimemin = k;
+			}
+			if (k > stat_ktimemax) {
+				stat_ktimemax = k;
+			}
+		}
+
+		/* a reflecting daemon gives back our own request, with b still 0 */
+		if (stamps && b != 0) {
+			int64_t tx, rx;
+			double dw;
+
+			tx = curr->ktx != 0 ? curr->ktx : curr->wtx;
+			rx = krx != 0 ? krx : clockreal();
+
+			dw = nstoms(stampdiff(b, a));
+
+			/* one-way delays are meaningful only if the clocks agree */
+			printf(" dwell=%.3f ms fwd=%.3f ms rev=%.3f ms",
+				dw, nstoms(stampdiff(a, tx)), nstoms(stampdiff(rx, b)));
+
+			stat_dcount++;
+			stat_dtimesum += dw;
+			if (dw < stat_dtimemin) {
+				stat_dtimemin = dw;
+			}
+			if (dw > stat_dtimemax) {
+				stat_dtimemax = dw;
+			}
 		}
 
-		dtv = xtimersub(&now, &(*curr)->t);
-		d = tvtoms(&dtv);
-		assert(d >= 0);
+		printf("\n");
+
+		histadd(&stat_rtt, rtt);
+		histadd(&win.rtt, rtt);
+
+		capture(curr, seq, now, len, CAP_REPLY);
 
-		printf("%d bytes from %s seq=%d time=%.3f ms\n",
-			(int) strlen(buf) + 1, inet_ntoa(sin.sin_addr), seq, d);
+		/* including any delay in sending, which would otherwise go unseen */
+		d = nstoms(rtt + (curr->t - curr->due));
 
-		stat_timesum += d;
-		stat_timesqr += pow(d, 2);
-		if (d < stat_timemin) {
-			stat_timemin = d;
+		stat_stimesum += d;
+		if (d < stat_stimemin) {
+			stat_stimemin = d;
 		}
-		if (d > stat_timemax) {
-			stat_timemax = d;
+		if (d > stat_stimemax) {
+			stat_stimemax = d;
 		}
 	}
 
-	removepending(curr);
+	if (!echoed) {
+		pendremove(pt, curr);
+	}
 }
 
 /*
- * Cull pending packets older than TIMEOUT seconds.
+ * Wait up to ns for s to become readable, as select() does. With -b, this
+ * spins rather than sleeps: s is nonblocking, the caller's receive is the
+ * poll, and so s is reported readable until the time is up.
+ */
+static int
+waitrecv(int s, int64_t ns)
+{
+	struct timeval tv;
+	fd_set rfds;
+
+	if (busy && s != -1) {
+		return ns > 0;
+	}
+
+	tv = nstotv(ns);
+
+	FD_ZERO(&rfds);
+	if (s != -1) {
+		FD_SET(s, &rfds);
+	}
+
+	return select(s + 1, &rfds, NULL, NULL, &tv);
+}
+
+/*
+ * Cull pending packets older than TIMEOUT. These are in the order sent,
+ * so only those which have expired need be visited.
  */
 static void
-culltimeouts(struct pending **p)
+culltimeouts(struct pendtab *pt, int64_t now)
 {
-	struct pending **curr;
-	struct pending **next;
-	struct timeval now;
+	struct pending *curr;
 
-	if (-1 == gettimeofday(&now, NULL)) {
-		perror("gettimeofday");
-		exit(EXIT_FAILURE);
+	if (echoed) {
+		cullseen(now);
+		return;
 	}
 
-	for (curr = p; *curr; curr = next) {
-		struct timeval dtv;
-		double d;
+	while (curr = pendoldest(pt), curr != NULL) {
+		if (now - curr->t < TIMEOUT) {
+			break;
+		}
 
-		dtv = xtimersub(&now, &(*curr)->t);
-		d = tvtoms(&dtv);
-		if (d > TIMEOUT) {
-			stat_timedout++;
-			printf("timeout: seq=%d time=%.3f ms\n", (*curr)->seq, d);
-			removepending(curr);
-			next = curr;
-		} else {
-			next = &(*curr)->next;
+		stat_timedout++;
+		win.timedout++;
+		printf("timeout: seq=%d time=%.3f ms\n", curr->seq, nstoms(now - curr->t));
+		capture(curr, curr->seq, now, 0, CAP_TIMEOUT);
+		pendremove(pt, curr);
+	}
+}
+
+/*
+ * The time from now until the oldest pending packet times out. Returns 0
+ * if there are none pending.
+ */
+static int
+nextexpiry(struct pendtab *pt, int64_t now, int64_t *ns)
+{
+	struct pending *oldest;
+
+	if (echoed) {
+		int64_t t;
+
+		if (!seennext(&seen, &t)) {
+			return 0;
+		}
+
+		*ns = t - now;
+		if (*ns < 0) {
+			*ns = 0;
 		}
+
+		return 1;
 	}
+
+	oldest = pendoldest(pt);
+	if (oldest == NULL) {
+		return 0;
+	}
+
+	*ns = oldest->t + TIMEOUT - now;
+	if (*ns < 0) {
+		*ns = 0;
+	}
+
+	return 1;
 }
 
 static void
 printstats(FILE *f, int multiline)
 {
-	double avg;
-	double variance;
-
 	assert(f != NULL);
 
+	if (multiline) {
+		fprintf(f, "%lu bytes per message\n",
+			(unsigned long) (proto2 ? PING2_LEN + ECHO_LEN * echoed + payload : PING_LEN + 1));
+	}
+
 	fprintf(f, multiline ? "%u transmitted, "
 	                       "%u received, "
 	                       "%u timed out, "
@@ -380,7 +748,7 @@ printstats(FILE *f, int multiline)
 		stat_sent, stat_recieved, stat_timedout, stat_ignored,
 		(stat_sent - stat_recieved) * 100.0 / stat_sent);
 
-	if (stat_recieved == 0) {
+	if (stat_rtt.n == 0) {
 		fprintf(f, "\n");
 		return;
 	}
@@ -389,27 +757,102 @@ printstats(FILE *f, int multiline)
 	                       "round-trip "
 	                     : ", ");
 
-	/* Calculate statistics */
-	avg = stat_timesum / stat_recieved;
+	fprintf(f, "min/avg/max/stddev = "
+		   "%.3f/%.3f/%.3f/%.3f ms",
+		nstoms(stat_rtt.min), stat_rtt.mean / NS_PER_MS, nstoms(stat_rtt.max),
+		histstddev(&stat_rtt) / NS_PER_MS);
 
-	if (stat_recieved == 1) {
-		fprintf(f, "min/avg/max = "
-			   "%.3f/%.3f/%.3f\n",
-			stat_timemin, avg, stat_timemax);
-	} else {
-		variance = (stat_timesqr - stat_recieved * pow(avg, 2))
-			/ (stat_recieved - 1);
+	fprintf(f, multiline ? "\n"
+	                       "round-trip "
+	                     : ", ");
+
+	fprintf(f, "p50/p90/p99/p99.9/p99.99 = "
+		   "%.3f/%.3f/%.3f/%.3f/%.3f ms\n",
+		nstoms(histpct(&stat_rtt, 50)), nstoms(histpct(&stat_rtt, 90)),
+		nstoms(histpct(&stat_rtt, 99)), nstoms(histpct(&stat_rtt, 99.9)),
+		nstoms(histpct(&stat_rtt, 99.99)));
+
+	fprintf(f, "%sscheduled min/avg/max = %.3f/%.3f/%.3f ms\n",
+		multiline ? "round-trip " : "",
+		stat_stimemin, stat_stimesum / stat_rtt.n, stat_stimemax);
 
-		fprintf(f, "min/avg/max/stddev = "
-			   "%.3f/%.3f/%.3f/%.3f ms\n",
-			stat_timemin, avg, stat_timemax, sqrt(variance));
+	if (stat_kcount > 0) {
+		fprintf(f, "%skernel min/avg/max = %.3f/%.3f/%.3f ms\n",
+			multiline ? "round-trip " : "",
+			stat_ktimemin, stat_ktimesum / stat_kcount, stat_ktimemax);
+	}
+
+	if (stat_dcount > 0) {
+		fprintf(f, "%sserver dwell min/avg/max = %.3f/%.3f/%.3f ms\n",
+			multiline ? "round-trip " : "",
+			stat_dtimemin, stat_dtimesum / stat_dcount, stat_dtimemax);
+	}
+
+	if (stat_sent > 1 && stat_last > stat_first) {
+		fprintf(f, "%srate achieved/requested = %.3f/%.3f per second\n",
+			multiline ? "send " : "",
+			(stat_sent - 1) * (double) NS_PER_SEC / (stat_last - stat_first),
+			schedrate(&sched));
+	}
+}
+
+/*
+ * Print statistics for the window since the last report, with running
+ * totals, and start the next window. Loss is taken over the pings
+ * resolved (answered or timed out) in each window, so that pings still
+ * in flight at the edges of a window are not counted as lost.
+ */
+static void
+printreport(FILE *f, int64_t now)
+{
+	uint64_t resolved;
+	int64_t start;
+
+	assert(f != NULL);
+	assert(report > 0);
+
+	resolved = win.rtt.n + win.timedout;
+
+	fprintf(f, "%.3f-%.3f s: %u/%u packets, %u timed out, %u disregarded, %.1f%% loss",
+		(win.start - stat_start) / (double) NS_PER_SEC,
+		(win.end - stat_start) / (double) NS_PER_SEC,
+		win.sent, win.recieved, win.timedout, win.ignored,
+		resolved == 0 ? 0.0 : win.timedout * 100.0 / resolved);
+
+	if (win.rtt.n > 0) {
+		fprintf(f, ", p50/p90/p99/max = %.3f/%.3f/%.3f/%.3f ms",
+			nstoms(histpct(&win.rtt, 50)), nstoms(histpct(&win.rtt, 90)),
+			nstoms(histpct(&win.rtt, 99)), nstoms(win.rtt.max));
+	}
+
+	resolved = stat_rtt.n + stat_timedout;
+
+	fprintf(f, "; total %u/%u packets, %.1f%% loss",
+		stat_sent, stat_recieved,
+		resolved == 0 ? 0.0 : stat_timedout * 100.0 / resolved);
+
+	if (stat_rtt.n > 0) {
+		fprintf(f, ", p99 = %.3f ms",
+			nstoms(histpct(&stat_rtt, 99)));
+	}
+
+	fprintf(f, "\n");
+
+	/* if reports have fallen behind, the next window covers the gap */
+	start = win.end;
+	memset(&win, 0, sizeof win);
+	win.start = start;
+	win.end = start + report;
+	while (win.end <= now) {
+		win.end += report;
 	}
 }
 
 static void
 usage(void) {
-	fprintf(stderr, "usage: dgping [ -c <count> ] [ -i interval ] "
-		"<address> <port>\n");
+	fprintf(stderr, "usage: dgping [ -2 ] [ -C ] [ -e ] [ -b ] [ -a <cpu> ] [ -f <priority> ] [ -d ] [ -k ]\n"
+		"\t[ -c <count> ] [ -i interval ] [ -I <interval> ] [ -S <schedule> ]\n"
+		"\t[ -s <bytes> ] [ -w <file> ] <address> <port>\n");
 }
 
 int
@@ -418,11 +861,13 @@ main(int argc, char **argv)
 	int s;
 	int count;
 	uint16_t seq;
-	struct pending *p;
+	int64_t next;
+	struct pendtab pt;
 	struct sockaddr_in sin;
 	struct sigaction sigact;
+	const char *schedspec;
+	const char *capfile;
 	sigset_t set;
-	double interval;
 
 	sigemptyset(&set);
 	(void) sigaddset(&set, SIGINT);
@@ -436,15 +881,59 @@ main(int argc, char **argv)
 	sigact.sa_flags   = 0;
 
 	/* defaults */
-	interval = INTERVAL;
+
+	schedspec = "constant";
+	capfile = NULL;
 
 	/* Handle CLI options */
 	count = 0;
 	{
 		int c;
 
-		while ((c = getopt(argc, argv, "hc:i:")) != -1) {
+		while ((c = getopt(argc, argv, "2Ca:bc:def:hi:I:kS:s:w:")) != -1) {
 			switch (c) {
+			case 'a':
+				cpu = atoi(optarg);
+				if (cpu < 0 || optarg[strspn(optarg, "0123456789")]) {
+					fprintf(stderr, "Invalid CPU\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'b':
+				busy = 1;
+				break;
+
+			case 'f':
+				prio = atoi(optarg);
+				if (prio <= 0 || optarg[strspn(optarg, "0123456789")]) {
+					fprintf(stderr, "Invalid priority\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'd':
+				stamps = 1;
+				break;
+
+			case '2':
+				proto2 = 1;
+				break;
+
+			case 'C':
+				crc = 1;
+				proto2 = 1;
+				break;
+
+			case 'e':
+				echoed = 1;
+				proto2 = 1;
+				break;
+
+			case 'k':
+				ktimes = 1;
+				break;
+
 			case 'c':
 				count = atoi(optarg);
 				if (count <= 0) {
@@ -454,13 +943,40 @@ main(int argc, char **argv)
 				break;
 
 			case 'i':
-				interval = atof(optarg) * 1000.0;
-				if (interval < DBL_EPSILON) {
+				interval = sectons(atof(optarg));
+				if (interval <= 0) {
 					fprintf(stderr, "Invalid ping interval\n");
 					return EXIT_FAILURE;
 				}
 				break;
 
+			case 'S':
+				schedspec = optarg;
+				break;
+
+			case 's':
+				payload = strtoul(optarg, NULL, 10);
+				if (payload > DGRAM_MAXLEN - PING2_LEN || optarg[strspn(optarg, "0123456789")]) {
+					fprintf(stderr, "Invalid payload size; at most %d bytes\n",
+						DGRAM_MAXLEN - PING2_LEN);
+					return EXIT_FAILURE;
+				}
+				/* only version 2 messages carry a payload */
+				proto2 = 1;
+				break;
+
+			case 'w':
+				capfile = optarg;
+				break;
+
+			case 'I':
+				report = sectons(atof(optarg));
+				if (report <= 0) {
+					fprintf(stderr, "Invalid report interval\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
 			case '?':
 			case 'h':
 			default:
@@ -472,6 +988,22 @@ main(int argc, char **argv)
 		argv += optind;
 	}
 
+	/* kernel timestamps arrive apart from the reply, with nowhere to keep them */
+	if (echoed && ktimes) {
+		fprintf(stderr, "-e and -k are mutually exclusive\n");
+		return EXIT_FAILURE;
+	}
+
+	if (echoed && payload > DGRAM_MAXLEN - PING2_LEN - ECHO_LEN) {
+		fprintf(stderr, "Invalid payload size; at most %d bytes with -e\n",
+			DGRAM_MAXLEN - PING2_LEN - ECHO_LEN);
+		return EXIT_FAILURE;
+	}
+
+	if (-1 == schedparse(&sched, schedspec, interval)) {
+		return EXIT_FAILURE;
+	}
+
 	if (2 != argc) {
 		usage();
 		return EXIT_FAILURE;
@@ -487,6 +1019,34 @@ main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (ktimes && -1 == tsenable(s, 1)) {
+		perror("SO_TIMESTAMPING");
+		return EXIT_FAILURE;
+	}
+
+	if (busy && -1 == busysock(s)) {
+		perror("fcntl");
+		return EXIT_FAILURE;
+	}
+
+	if (-1 == rtthread(cpu, prio)) {
+		return EXIT_FAILURE;
+	}
+
+	/* replies from another client, or an earlier run, are told apart by this */
+	session = (uint32_t) clockreal() ^ (uint32_t) getpid() << 16;
+
+	/* not secret, but enough that a reply must have come from one of our pings */
+	key = (uint64_t) clockreal() ^ (uint64_t) clocknow() << 32 ^ (uint64_t) getpid() << 48;
+
+	if (capfile != NULL) {
+		capf = capopen(capfile, interval);
+		if (capf == NULL) {
+			perror(capfile);
+			return EXIT_FAILURE;
+		}
+	}
+
 	if (0 != setvbuf(stdout, NULL, _IOLBF, 0)) {
 		perror("setvbuf");
 		return EXIT_FAILURE;
@@ -509,82 +1069,85 @@ main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	p = NULL;
-	for (seq = 0; !shouldexit; seq++) {
-		int r;
-		struct timeval t;
+	if (echoed) {
+		if (-1 == seeninit(&seen, TIMEOUT)) {
+			perror("seeninit");
+			return EXIT_FAILURE;
+		}
+	} else if (-1 == pendinit(&pt)) {
+		perror("pendinit");
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * Pings are sent open-loop, to a schedule of absolute deadlines, so
+	 * that time spent handling responses or signals does not accumulate
+	 * as drift. A ping sent late does not put back the next one.
+	 */
+	stat_start = clocknow();
+	next = schedfirst(&sched, stat_start);
 
-		sendecho(s, &p, seq);
+	win.start = stat_start;
+	win.end = stat_start + report;
 
+	for (seq = 0; !shouldexit && next != -1; seq++) {
 		/*
-		 * This loop is responsible for two things: delaying for 'interval',
-		 * whilst dealing with any incoming responses as and when they appear.
-		 * The latter must be as timely as possible, so it may interrupt the
-		 * interval delay.
-		 *
-		 * Once the delay is complete, a new ping is sent.
+		 * Until the next ping is due, deal with responses as and when
+		 * they appear, and with timeouts as they fall due.
 		 */
-		t = mstotv(interval);
-		xitimerfix(&t);
-		do {
-			struct timeval before, after;
-			fd_set rfds;
+		for (;;) {
+			int64_t now;
+			int64_t wait;
+			int r;
+
+			if (shouldexit) {
+				break;
+			}
 
 			if (shouldinfo) {
 				printstats(stderr, 0);
 				shouldinfo = 0;
 			}
 
-			if (-1 == gettimeofday(&before, NULL)) {
-				perror("gettimeofday");
-				exit(EXIT_FAILURE);
-			}
-
-			FD_ZERO(&rfds);
-			FD_SET(s, &rfds);
-			r = select(s + 1, &rfds, NULL, NULL, &t);
-			switch (r) {
-			case 0:
-				/* interval reached */
-				continue;
-
-			case -1:
-				break;
+			now = clocknow();
 
-			default:
-				/* handle activity */
-				if (FD_ISSET(s, &rfds)) {
-					recvecho(s, &p);
-				}
-
-				if (-1 == gettimeofday(&after, NULL)) {
-					perror("gettimeofday");
-					exit(EXIT_FAILURE);
-				}
+			culltimeouts(&pt, now);
 
-				{
-					struct timeval elapsed;
+			if (report != 0 && now >= win.end) {
+				printreport(stdout, now);
+			}
 
-					elapsed = xtimersub(&after, &before);
-					t = mstotv(interval);
-					t = xtimersub(&t, &elapsed);
-					xitimerfix(&t);
-				}
+			if (now >= next) {
+				break;
+			}
 
-				continue;
+			/* wake for whichever is sooner; the next ping, or the next timeout */
+			if (!nextexpiry(&pt, now, &wait) || wait > next - now) {
+				wait = next - now;
 			}
 
-			switch (errno) {
-			case EINTR:
-				continue;
+			if (report != 0 && wait > win.end - now) {
+				wait = win.end - now;
+			}
 
-			default:
+			r = waitrecv(s, wait);
+			if (r == -1 && errno != EINTR) {
 				perror("select");
 				return EXIT_FAILURE;
 			}
-		} while (!shouldexit && 0 != r);
 
-		culltimeouts(&p);
+			/* handle activity */
+			if (r > 0) {
+				recvecho(s, &pt);
+			}
+		}
+
+		if (shouldexit) {
+			break;
+		}
+
+		sendecho(s, &pt, seq, next);
+		next = schednext(&sched, next);
 
 		if (count != 0 && seq + 1 >= count) {
 			break;
@@ -609,13 +1172,41 @@ main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	while (!shouldexit && p != NULL) {
-		recvecho(s, &p);
+	while (!shouldexit && (echoed ? seen.out : pt.n) > 0) {
+		int64_t now, wait;
+		int r;
+
+		now = clocknow();
+
+		culltimeouts(&pt, now);
+
+		if (!nextexpiry(&pt, now, &wait)) {
+			break;
+		}
 
-		culltimeouts(&p);
+		r = waitrecv(s, wait);
+		if (r == -1 && errno != EINTR) {
+			perror("select");
+			return EXIT_FAILURE;
+		}
+
+		if (r > 0) {
+			recvecho(s, &pt);
+		}
 	}
 
 	close(s);
+	if (echoed) {
+		seenfini(&seen);
+	} else {
+		pendfini(&pt);
+	}
+	schedfini(&sched);
+
+	if (capf != NULL && -1 == capclose(capf)) {
+		perror(capfile);
+		return EXIT_FAILURE;
+	}
 
 	fprintf(stdout, "\n- DGRAM Ping Statistics -\n");
 	printstats(stdout, 1);
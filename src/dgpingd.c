@@ -6,21 +6,102 @@
 
 #define _GNU_SOURCE
 
+/*
+ * recvmmsg(2) and sendmmsg(2) are used for reflection where available;
+ * otherwise datagrams are reflected one at a time.
+ */
+#if (defined(__linux__) || defined(__FreeBSD__)) && !defined(__EMSCRIPTEN__) && !defined(NO_MMSG)
+# define HAVE_MMSG
+#endif
+
+/*
+ * Workers may be pinned to CPUs, where the platform allows it.
+ */
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+# define HAVE_AFFINITY
+#endif
+
+/*
+ * SO_REUSEPORT_LB is FreeBSD's load-balancing variant; elsewhere
+ * SO_REUSEPORT distributes datagrams between sockets (on Linux, at least).
+ */
 #include <sys/socket.h>
+#if defined(SO_REUSEPORT_LB)
+# define HAVE_REUSEPORT SO_REUSEPORT_LB
+#elif defined(SO_REUSEPORT)
+# define HAVE_REUSEPORT SO_REUSEPORT
+#endif
+
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <poll.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "common.h"
+#include "tstamp.h"
+#include "busy.h"
+#include "uring.h"
+
+/*
+ * The number of datagrams moved per recvmmsg(2) in reflector mode,
+ * and the largest datagram reflected whole.
+ */
+#define REFLECT_BATCH 64
+#define REFLECT_BUFSZ DGRAM_MAXLEN
+
+/*
+ * Each worker has its own socket, bound with SO_REUSEPORT when there are
+ * several, so the kernel spreads flows between them.
+ *
+ * The count of datagrams answered is written by its worker only, and read
+ * by the main thread at exit.
+ */
+struct worker {
+	pthread_t tid;
+	int s;
+	int cpu; /* -1 for unpinned */
+	struct sockaddr_in sin;
+	unsigned long count;
+};
+
+/* far more threads than any machine has CPUs to run them on */
+#define MAX_WORKERS 1024
+
+static int reflector;
+static int uring;
+static int busy;
+static int prio;
+
+/*
+ * Set by the main thread on SIGINT or SIGTERM, before it shuts down each
+ * socket to wake the worker waiting on it.
+ */
+static int stopping;
 
 static int
-bindon(int s, struct sockaddr_in *sin)
+stopped(void)
+{
+	return __atomic_load_n(&stopping, __ATOMIC_RELAXED);
+}
+
+static void
+tally(unsigned long *count, unsigned long n)
+{
+	__atomic_store_n(count, *count + n, __ATOMIC_RELAXED);
+}
+
+static int
+bindon(int s, struct sockaddr_in *sin, int reuseport)
 {
 	const int ov = 1;
 
@@ -30,6 +111,20 @@ bindon(int s, struct sockaddr_in *sin)
 		return -1;
 	}
 
+	if (reuseport) {
+#ifdef HAVE_REUSEPORT
+		if (-1 == setsockopt(s, SOL_SOCKET, HAVE_REUSEPORT, &ov, sizeof ov)) {
+			perror("setsockopt");
+			close(s);
+			return -1;
+		}
+#else
+		fprintf(stderr, "SO_REUSEPORT is not supported\n");
+		close(s);
+		return -1;
+#endif
+	}
+
 	if (-1 == bind(s, (void *) sin, sizeof *sin)) {
 		perror("bind");
 		close(s);
@@ -39,79 +134,713 @@ bindon(int s, struct sockaddr_in *sin)
 	return s;
 }
 
-static int
-recvecho(int s, uint16_t *seq, struct sockaddr_in *sin, socklen_t sinsz)
+/*
+ * Answer a message of either version, of n bytes in buf (which has room
+ * for size), in place. kts is the kernel's receive timestamp, or 0.
+ * Returns the length of the reply, or 0 if there is none.
+ */
+static size_t
+answer(char *buf, size_t n, size_t size, const struct sockaddr_in *sin,
+	int64_t kts)
 {
-	char buf[1024];
+	const char *reply;
+	uint16_t seq;
+
+	assert(buf != NULL);
+	assert(size > PING_LEN + 1);
+	assert(n < size);
+
+	if (isping2(buf, n)) {
+		struct ping2 p;
+
+		if (1 != getping2(buf, n, &p)) {
+			return 0;
+		}
+
+		printf("%lu bytes from %s seq=%llu\n", (unsigned long) n,
+			inet_ntoa(sin->sin_addr), (unsigned long long) p.seq);
+
+		reply2(buf, n, kts, &p);
+
+		return n;
+	}
+
+	buf[n] = '\0';
+
+	if (1 != validate(buf, &seq)) {
+		return 0;
+	}
+
+	printf("%d bytes from %s seq=%d\n", (int) strlen(buf) + 1, inet_ntoa(sin->sin_addr), seq);
+
+	reply = mkreply(seq, stamprx(buf, kts));
+
+	n = strlen(reply) + 1;
+	memcpy(buf, reply, n);
+
+	return n;
+}
+
+/*
+ * Receive a message into buf, and make the reply to it there.
+ * Returns the length of the reply, or 0 if there is none.
+ */
+static size_t
+recvecho(int s, char *buf, size_t size, struct sockaddr_in *sin, socklen_t sinsz)
+{
+	int64_t kts;
 	ssize_t r;
 
-	r = recvfrom(s, buf, sizeof buf, 0, (void *) sin, &sinsz);
+	r = tsrecv(s, buf, size - 1, 0, (void *) sin, &sinsz, &kts);
 	if (-1 == r) {
-		perror("recvfrom");
+		switch (errno) {
+		case EAGAIN: /* spinning, for -b */
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			break;
+
+		default:
+			perror("recvfrom");
+			break;
+		}
+
 		return 0;
 	}
 
-	if (1 != validate(buf, seq)) {
+	/* woken by shutdown(), with nothing to answer */
+	if (stopped()) {
 		return 0;
 	}
 
-	printf("%d bytes from %s seq=%d\n", (int) strlen(buf) + 1, inet_ntoa(sin->sin_addr), *seq);
-	return 1;
+	return answer(buf, r, size, sin, kts);
 }
 
 static void
-sendecho(int s, uint16_t seq, struct sockaddr_in *sin)
+sendecho(int s, const char *buf, size_t n, struct sockaddr_in *sin)
 {
-	const char *buf;
+	if (-1 == sendto(s, buf, n, 0, (void *) sin, sizeof *sin)) {
+		perror("sendto");
+	}
+}
 
-	buf = mkping(seq);
+/*
+ * Reflector mode: every datagram is sent back to its source as-is, without
+ * validating, reformatting or printing. Returns -1 on error, or 0 once
+ * stopped.
+ */
+#ifdef HAVE_MMSG
 
-	if (-1 == sendto(s, buf, strlen(buf) + 1, 0, (void *) sin, sizeof *sin)) {
-		perror("sendto");
+static int
+reflect(int s, unsigned long *count)
+{
+	char (*bufs)[REFLECT_BUFSZ];
+	struct sockaddr_in names[REFLECT_BATCH];
+	struct mmsghdr msgs[REFLECT_BATCH];
+	struct iovec iovs[REFLECT_BATCH];
+	unsigned i;
+
+	assert(count != NULL);
+
+	bufs = malloc(REFLECT_BATCH * sizeof *bufs);
+	if (bufs == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	while (!stopped()) {
+		int n, k, r;
+
+		for (i = 0; i < REFLECT_BATCH; i++) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len  = sizeof bufs[i];
+
+			memset(&msgs[i], 0, sizeof msgs[i]);
+			msgs[i].msg_hdr.msg_name    = &names[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof names[i];
+			msgs[i].msg_hdr.msg_iov     = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen  = 1;
+		}
+
+		/* block for the first datagram, then take whatever else is queued */
+		n = recvmmsg(s, msgs, REFLECT_BATCH, MSG_WAITFORONE, NULL);
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+				continue;
+			}
+
+			perror("recvmmsg");
+			free(bufs);
+			return -1;
+		}
+
+		/* woken by shutdown(), with nothing to reflect */
+		if (stopped()) {
+			break;
+		}
+
+		/* echo just the bytes received; msg_namelen is as recvmmsg left it */
+		for (k = 0; k < n; k++) {
+			iovs[k].iov_len = msgs[k].msg_len;
+		}
+
+		for (k = 0; k < n; k += r) {
+			r = sendmmsg(s, msgs + k, n - k, 0);
+			if (r == -1) {
+				if (errno == EINTR) {
+					r = 0;
+					continue;
+				}
+
+				/* skip the datagram which failed, and carry on */
+				perror("sendmmsg");
+				r = 1;
+				continue;
+			}
+
+			tally(count, r);
+		}
+	}
+
+	free(bufs);
+
+	return 0;
+}
+
+#else
+
+static int
+reflect(int s, unsigned long *count)
+{
+	char buf[REFLECT_BUFSZ];
+
+	assert(count != NULL);
+
+	while (!stopped()) {
+		struct sockaddr_in sin;
+		socklen_t sinsz;
+		ssize_t r;
+
+		sinsz = sizeof sin;
+
+		r = recvfrom(s, buf, sizeof buf, 0, (void *) &sin, &sinsz);
+		if (r == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+				continue;
+			}
+
+			perror("recvfrom");
+			return -1;
+		}
+
+		/* woken by shutdown(), with nothing to reflect */
+		if (stopped()) {
+			break;
+		}
+
+		if (-1 == sendto(s, buf, r, 0, (void *) &sin, sinsz)) {
+			perror("sendto");
+			continue;
+		}
+
+		tally(count, 1);
+	}
+
+	return 0;
+}
+
+#endif
+
+#ifdef HAVE_URING
+
+/*
+ * Each buffer holds a struct io_uring_recvmsg_out and the name before the
+ * datagram, and is a whole number of pages, so that each header is aligned.
+ * These are mapped, and so the pages for the longest datagrams are only
+ * touched if such datagrams arrive; 64 of them (4.25 MiB of address space)
+ * are enough to batch, and the socket holds any more until they are reaped.
+ *
+ * Replies in flight are sized for pings without payload; a longer reply
+ * is sent synchronously, as when all are in flight.
+ */
+#define URING_BUFS  64
+#define URING_BUFSZ ((DGRAM_MAXLEN + 256 + 4095) / 4096 * 4096)
+#define URING_SENDS 256
+#define REPLY_BUFSZ 2048
+
+/*
+ * A reply in flight; this must persist until its send completes.
+ */
+struct reply {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_in sin;
+	char buf[REPLY_BUFSZ];
+	struct reply *next;
+};
+
+/*
+ * The user_data of the poll armed by armstop(). Receives are 0, and
+ * sends are their struct reply.
+ */
+#define URING_STOP 1
+
+/*
+ * A multishot receive is not ended by shutdown(), having nothing to
+ * receive, so a poll is kept on the socket to see the main thread shut
+ * it down. The ring is empty when this is armed, so there is room.
+ */
+static void
+armstop(struct uring *u, int s)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(u);
+	if (sqe == NULL) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+
+	sqe->opcode      = IORING_OP_POLL_ADD;
+	sqe->fd          = s;
+	sqe->poll_events = POLLHUP;
+	sqe->user_data   = URING_STOP;
+}
+
+/*
+ * Returns 0 if there is no room to submit this yet; see uring_sqe().
+ */
+static int
+armrecv(struct uring *u, int s, struct msghdr *m)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(u);
+	if (sqe == NULL && errno == EBUSY) {
+		return 0;
 	}
+
+	if (sqe == NULL) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+
+	sqe->opcode    = IORING_OP_RECVMSG;
+	sqe->fd        = s;
+	sqe->addr      = (uintptr_t) m;
+	sqe->len       = 1;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->user_data = 0;
+
+	return 1;
+}
+
+/*
+ * io_uring(7) event loop. A single multishot receive stays armed, delivering
+ * datagrams into kernel-selected buffers, and replies are queued as sends
+ * without waiting on them; many of each are reaped per io_uring_enter().
+ *
+ * Returns -1 if io_uring is unavailable, in which case nothing has been
+ * consumed from the socket, or 0 once stopped.
+ */
+static int
+serve_uring(int s, unsigned long *count)
+{
+	struct reply *replies;
+	struct reply *idle;
+	struct msghdr m;
+	struct uring u;
+	int armed;
+	size_t i;
+
+	if (-1 == uring_init(&u, URING_SENDS * 2, URING_BUFS, URING_BUFSZ)) {
+		perror("io_uring");
+		return -1;
+	}
+
+	replies = calloc(URING_SENDS, sizeof *replies);
+	if (replies == NULL) {
+		perror("calloc");
+		uring_fini(&u);
+		return -1;
+	}
+
+	idle = NULL;
+	for (i = 0; i < URING_SENDS; i++) {
+		replies[i].next = idle;
+		idle = &replies[i];
+	}
+
+	/* template for multishot recvmsg; only the name length is used */
+	memset(&m, 0, sizeof m);
+	m.msg_namelen = sizeof (struct sockaddr_in);
+
+	armstop(&u, s);
+	armed = armrecv(&u, s, &m);
+
+	while (!stopped()) {
+		struct io_uring_cqe *cqe;
+
+		if (!armed) {
+			armed = armrecv(&u, s, &m);
+		}
+
+		/* EBUSY: completions are backed up, and are reaped before trying again */
+		if (-1 == uring_submit(&u, 1) && errno != EBUSY && errno != EAGAIN) {
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+
+		while (cqe = uring_cqe(&u), cqe != NULL) {
+			struct reply *r;
+
+			if (cqe->user_data == URING_STOP) {
+				uring_seen(&u);
+				continue;
+			}
+
+			/* send completion */
+			if (cqe->user_data != 0) {
+				r = (void *) (uintptr_t) cqe->user_data;
+
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					perror("sendmsg");
+				}
+
+				r->next = idle;
+				idle = r;
+
+				uring_seen(&u);
+				continue;
+			}
+
+			/* receive completion */
+			if (cqe->res < 0) {
+				/* ENOBUFS: we ran out of provided buffers, and will re-arm */
+				if (cqe->res != -ENOBUFS && !stopped()) {
+					errno = -cqe->res;
+					perror("recvmsg");
+				}
+			} else {
+				const struct io_uring_recvmsg_out *o;
+				struct io_uring_sqe *sqe;
+				struct sockaddr_in sin;
+				char local[DGRAM_MAXLEN + 1];
+				const char *p;
+				char *buf;
+				size_t n;
+
+				o = uring_buf(&u, cqe);
+				p = (const char *) (o + 1);
+
+				memset(&sin, 0, sizeof sin);
+				memcpy(&sin, p, o->namelen < sizeof sin ? o->namelen : sizeof sin);
+
+				p += m.msg_namelen + m.msg_controllen;
+				n = o->payloadlen < DGRAM_MAXLEN ? o->payloadlen : DGRAM_MAXLEN;
+
+				/* the reply is made in place, in the slot it will be sent from */
+				r = n < sizeof idle->buf ? idle : NULL;
+				buf = r != NULL ? r->buf : local;
+
+				memcpy(buf, p, n);
+
+				/* the kernel's receive timestamp is not asked for here */
+				n = answer(buf, n, r != NULL ? sizeof r->buf : sizeof local, &sin, 0);
+
+				if (n > 0) {
+					tally(count, 1);
+
+					sqe = r != NULL ? uring_sqe(&u) : NULL;
+					if (sqe == NULL && r != NULL && errno != EBUSY) {
+						perror("io_uring_enter");
+						exit(EXIT_FAILURE);
+					}
+
+					if (sqe == NULL) {
+						/* all replies in flight, too long, or no room to submit; send synchronously */
+						sendecho(s, buf, n, &sin);
+					} else {
+						idle = r->next;
+
+						r->sin = sin;
+						r->iov.iov_base = r->buf;
+						r->iov.iov_len  = n;
+						memset(&r->msg, 0, sizeof r->msg);
+						r->msg.msg_name    = &r->sin;
+						r->msg.msg_namelen = sizeof r->sin;
+						r->msg.msg_iov     = &r->iov;
+						r->msg.msg_iovlen  = 1;
+
+						sqe->opcode    = IORING_OP_SENDMSG;
+						sqe->fd        = s;
+						sqe->addr      = (uintptr_t) &r->msg;
+						sqe->len       = 1;
+						sqe->user_data = (uintptr_t) r;
+					}
+				}
+
+				uring_recycle(&u, cqe);
+			}
+
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				armed = armrecv(&u, s, &m);
+			}
+
+			uring_seen(&u);
+		}
+	}
+
+	uring_fini(&u);
+	free(replies);
+
+	return 0;
+}
+
+#endif
+
+static int
+run(struct worker *w)
+{
+	assert(w != NULL);
+
+	if (reflector) {
+		return reflect(w->s, &w->count);
+	}
+
+	if (uring) {
+#ifdef HAVE_URING
+		if (0 == serve_uring(w->s, &w->count)) {
+			return 0;
+		}
+#endif
+		fprintf(stderr, "io_uring unavailable; falling back to recvfrom()\n");
+	}
+
+	while (!stopped()) {
+		struct sockaddr_in sin;
+		char buf[DGRAM_MAXLEN + 1];
+		size_t n;
+
+		n = recvecho(w->s, buf, sizeof buf, &sin, sizeof sin);
+		if (n > 0) {
+			sendecho(w->s, buf, n, &sin);
+			tally(&w->count, 1);
+		}
+	}
+
+	return 0;
+}
+
+static void *
+work(void *arg)
+{
+	struct worker *w = arg;
+
+	if (-1 == rtthread(w->cpu, prio)) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (-1 == run(w)) {
+		exit(EXIT_FAILURE);
+	}
+
+	close(w->s);
+
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: dgpingd [ -r | -u ] [ -b ] [ -p ] [ -f <priority> ] [ -w <threads> ]\n"
+		"\t<address> <port>\n");
 }
 
 int
 main(int argc, char *argv[])
 {
-	int s;
-	struct sockaddr_in sin;
+	struct worker *workers;
+	unsigned nworkers;
+	unsigned long count;
+	sigset_t set;
+	unsigned i;
+	int pin;
+	int sig;
 
-	if (3 != argc) {
-		fprintf(stderr, "usage: dgpingd <address> <port>\n");
-		return EXIT_FAILURE;
+	nworkers = 1;
+	pin = 0;
+
+	/* Handle CLI options */
+	{
+		int c;
+
+		while ((c = getopt(argc, argv, "bf:hpruw:")) != -1) {
+			switch (c) {
+			case 'b':
+				busy = 1;
+				break;
+
+			case 'f':
+				prio = atoi(optarg);
+				if (prio <= 0 || optarg[strspn(optarg, "0123456789")]) {
+					fprintf(stderr, "Invalid priority\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'p':
+#ifndef HAVE_AFFINITY
+				fprintf(stderr, "CPU pinning is not supported\n");
+				return EXIT_FAILURE;
+#endif
+				pin = 1;
+				break;
+
+			case 'r':
+				reflector = 1;
+				break;
+
+			case 'u':
+				uring = 1;
+				break;
+
+			case 'w':
+				{
+					unsigned long l;
+					char *ep;
+
+					l = strtoul(optarg, &ep, 10);
+					if (ep == optarg || *ep || l == 0 || l > MAX_WORKERS) {
+						fprintf(stderr, "Invalid thread count; expected 1 to %d\n", MAX_WORKERS);
+						return EXIT_FAILURE;
+					}
+
+					nworkers = l;
+				}
+				break;
+
+			case '?':
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+		argc -= optind;
+		argv += optind;
 	}
 
-	s = getaddr(argv[1], argv[2], &sin, SOCK_DGRAM, IPPROTO_UDP);
-	if (-1 == s) {
+	if (2 != argc || (reflector && uring) || (busy && uring)) {
+		usage();
 		return EXIT_FAILURE;
 	}
 
-	/* TODO bind on INADDR_ANY instead? We could broadcast pings by default. */
-	s = bindon(s, &sin);
-	if (-1 == s) {
-		fprintf(stderr, "unable to listen\n");
+	workers = calloc(nworkers, sizeof *workers);
+	if (workers == NULL) {
+		perror("calloc");
 		return EXIT_FAILURE;
 	}
 
+	for (i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+
+		w->s = getaddr(argv[0], argv[1], &w->sin, SOCK_DGRAM, IPPROTO_UDP);
+		if (-1 == w->s) {
+			return EXIT_FAILURE;
+		}
+
+		/* TODO bind on INADDR_ANY instead? We could broadcast pings by default. */
+		w->s = bindon(w->s, &w->sin, nworkers > 1);
+		if (-1 == w->s) {
+			fprintf(stderr, "unable to listen\n");
+			return EXIT_FAILURE;
+		}
+
+		/* spin on receive, rather than sleep */
+		if (busy && -1 == busysock(w->s)) {
+			perror("fcntl");
+			return EXIT_FAILURE;
+		}
+
+		/*
+		 * For clients asking for timestamps. Where the kernel cannot
+		 * give them, we take our own instead.
+		 */
+		if (!reflector) {
+			(void) tsenable(w->s, 0);
+		}
+
+		w->cpu = -1;
+		w->count = 0;
+
+		if (pin) {
+			long ncpu;
+
+			ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+			w->cpu = ncpu > 0 ? (int) (i % ncpu) : (int) i;
+		}
+	}
+
 	if (0 != setvbuf(stdout, NULL, _IOLBF, 0)) {
 		perror("setvbuf");
 		return EXIT_FAILURE;
 	}
 
 	/* TODO find "UDP" automatically */
-	printf("listening on %s:%s %s\n", argv[1], argv[2], "UDP/IP");
+	printf("listening on %s:%s %s\n", argv[0], argv[1], "UDP/IP");
 
-	for (;;) {
-		uint16_t seq;
+	/*
+	 * The workers inherit this mask, so SIGINT and SIGTERM are left for
+	 * the main thread, which merges the counts on the way out.
+	 */
+	sigemptyset(&set);
+	(void) sigaddset(&set, SIGINT);
+	(void) sigaddset(&set, SIGTERM);
 
-		if (1 == recvecho(s, &seq, &sin, sizeof sin)) {
-			sendecho(s, seq, &sin);
+	if (0 != pthread_sigmask(SIG_BLOCK, &set, NULL)) {
+		perror("pthread_sigmask");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		int e;
+
+		e = pthread_create(&workers[i].tid, NULL, work, &workers[i]);
+		if (e != 0) {
+			errno = e;
+			perror("pthread_create");
+			return EXIT_FAILURE;
 		}
 	}
 
-	/* NOTREACHED */
+	if (0 != sigwait(&set, &sig)) {
+		perror("sigwait");
+		return EXIT_FAILURE;
+	}
+
+	/* each worker closes its socket, and its ring, once woken */
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < nworkers; i++) {
+		(void) shutdown(workers[i].s, SHUT_RDWR);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		(void) pthread_join(workers[i].tid, NULL);
+	}
+
+	count = 0;
+	for (i = 0; i < nworkers; i++) {
+		count += __atomic_load_n(&workers[i].count, __ATOMIC_RELAXED);
+	}
+
+	printf("%lu datagrams %s\n", count, reflector ? "reflected" : "answered");
+
+	free(workers);
 
 	return EXIT_SUCCESS;
 }
-
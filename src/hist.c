@@ -0,0 +1,139 @@
+/*
+ * A log-linear latency histogram. See hist.h.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "hist.h"
+
+static unsigned
+msb(uint64_t v)
+{
+	unsigned n;
+
+	assert(v != 0);
+
+	n = 0;
+	while (v >>= 1) {
+		n++;
+	}
+
+	return n;
+}
+
+static size_t
+bucket(int64_t v)
+{
+	unsigned e;
+
+	assert(v >= 0);
+
+	if (v < HIST_SUB) {
+		return v;
+	}
+
+	if (v >> HIST_MAXBITS) {
+		return HIST_BUCKETS - 1;
+	}
+
+	/* v >> e is in [HIST_SUB, 2 * HIST_SUB) */
+	e = msb(v) - HIST_SUBBITS;
+
+	return (size_t) e * HIST_SUB + (v >> e);
+}
+
+/* the largest value counted in bucket i */
+static int64_t
+highest(size_t i)
+{
+	unsigned e;
+
+	if (i < 2 * HIST_SUB) {
+		return i;
+	}
+
+	e = i / HIST_SUB - 1;
+
+	return ((int64_t) (i - (size_t) e * HIST_SUB + 1) << e) - 1;
+}
+
+/* See hist.h */
+void
+histadd(struct hist *h, int64_t v)
+{
+	double d;
+
+	assert(h != NULL);
+	assert(v >= 0);
+
+	h->count[bucket(v)]++;
+
+	if (h->n == 0 || v < h->min) {
+		h->min = v;
+	}
+	if (h->n == 0 || v > h->max) {
+		h->max = v;
+	}
+
+	h->n++;
+
+	d = v - h->mean;
+	h->mean += d / h->n;
+	h->m2   += d * (v - h->mean);
+}
+
+/* See hist.h */
+int64_t
+histpct(const struct hist *h, double p)
+{
+	uint64_t rank, seen;
+	size_t i;
+
+	assert(h != NULL);
+	assert(h->n > 0);
+	assert(p > 0 && p <= 100);
+
+	rank = (uint64_t) ceil(p / 100 * h->n);
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	seen = 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+
+	assert(i < HIST_BUCKETS);
+
+	/* the bucket's bound may lie beyond anything actually seen */
+	if (highest(i) > h->max) {
+		return h->max;
+	}
+
+	if (highest(i) < h->min) {
+		return h->min;
+	}
+
+	return highest(i);
+}
+
+/* See hist.h */
+double
+histstddev(const struct hist *h)
+{
+	assert(h != NULL);
+
+	if (h->n < 2) {
+		return 0;
+	}
+
+	return sqrt(h->m2 / (h->n - 1));
+}
+
@@ -0,0 +1,52 @@
+/*
+ * A latency histogram, log-linear in the manner of HdrHistogram.
+ *
+ * Each power of two is split into HIST_SUB equal buckets, so a value is
+ * reported to within 1/HIST_SUB of itself (under 1% here), whatever its
+ * magnitude. Memory is fixed, and recording a sample is constant-time.
+ * Values below HIST_SUB are counted exactly; values beyond about 39 hours
+ * are counted in the last bucket.
+ *
+ * The mean and variance are kept exactly, by Welford's method.
+ */
+
+#ifndef DG_HIST_H
+#define DG_HIST_H
+
+#include <stdint.h>
+
+#define HIST_SUBBITS 7
+#define HIST_SUB     (1 << HIST_SUBBITS)
+#define HIST_MAXBITS 47 /* in ns, a little over 39 hours */
+#define HIST_BUCKETS ((HIST_MAXBITS - HIST_SUBBITS + 2) * HIST_SUB)
+
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n;
+	int64_t min, max;
+	double mean;
+	double m2;
+};
+
+/*
+ * Record a value, which may not be negative. A zero-initialised
+ * struct hist is empty.
+ */
+void
+histadd(struct hist *h, int64_t v);
+
+/*
+ * The value at or below which p percent of values fall,
+ * for 0 < p <= 100. The histogram must not be empty.
+ */
+int64_t
+histpct(const struct hist *h, double p);
+
+/*
+ * The sample standard deviation, or 0 for fewer than two values.
+ */
+double
+histstddev(const struct hist *h);
+
+#endif
+
@@ -0,0 +1,119 @@
+/*
+ * Pings awaiting a response. See pending.h.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pending.h"
+
+/* See pending.h */
+int
+pendinit(struct pendtab *pt)
+{
+	assert(pt != NULL);
+
+	pt->slot = calloc(PENDING_SLOTS, sizeof *pt->slot);
+	if (pt->slot == NULL) {
+		return -1;
+	}
+
+	pt->tail = 0;
+	pt->head = 0;
+	pt->n    = 0;
+
+	return 0;
+}
+
+/* See pending.h */
+void
+pendfini(struct pendtab *pt)
+{
+	assert(pt != NULL);
+
+	free(pt->slot);
+}
+
+/* See pending.h */
+struct pending *
+pendadd(struct pendtab *pt, uint16_t seq, int64_t t)
+{
+	struct pending *p;
+
+	assert(pt != NULL);
+
+	p = &pt->slot[seq];
+
+	if (p->used) {
+		pendremove(pt, p);
+	}
+
+	p->t    = t;
+	p->due  = t;
+	p->ktx  = 0;
+	p->wtx  = 0;
+	p->n    = 0;
+	p->seq  = seq;
+	p->used = 1;
+
+	if (pt->n == 0) {
+		pt->tail = seq;
+	}
+
+	pt->head = seq + 1;
+	pt->n++;
+
+	return p;
+}
+
+/* See pending.h */
+struct pending *
+pendfind(struct pendtab *pt, uint16_t seq)
+{
+	assert(pt != NULL);
+
+	if (!pt->slot[seq].used) {
+		return NULL;
+	}
+
+	return &pt->slot[seq];
+}
+
+/* See pending.h */
+struct pending *
+pendoldest(struct pendtab *pt)
+{
+	assert(pt != NULL);
+
+	if (pt->n == 0) {
+		return NULL;
+	}
+
+	assert(pt->slot[pt->tail].used);
+
+	return &pt->slot[pt->tail];
+}
+
+/* See pending.h */
+void
+pendremove(struct pendtab *pt, struct pending *p)
+{
+	assert(pt != NULL);
+	assert(p != NULL);
+	assert(p->used);
+	assert(pt->n > 0);
+
+	p->used = 0;
+	pt->n--;
+
+	if (pt->n == 0) {
+		pt->tail = pt->head;
+		return;
+	}
+
+	/* each slot is stepped over at most once per lap of the sequence space */
+	while (!pt->slot[pt->tail].used) {
+		pt->tail++;
+	}
+}
@@ -0,0 +1,69 @@
+/*
+ * Pings awaiting a response, for dgping and stping.
+ *
+ * There is a preallocated slot per sequence number, so sending and matching
+ * a response are O(1), and memory is bounded however many responses go
+ * missing. Slots are kept in the order sent, from tail to head.
+ */
+
+#ifndef DG_PENDING_H
+#define DG_PENDING_H
+
+#include <stdint.h>
+
+#define PENDING_SLOTS (UINT16_MAX + 1UL)
+
+struct pending {
+	int64_t t;   /* sent, in ns; see clock.h */
+	int64_t due; /* when it was scheduled to be sent */
+	int64_t ktx; /* sent according to the kernel, or 0; see tstamp.h */
+	int64_t wtx; /* sent by the time of day, for -d, or 0 */
+	uint64_t n;  /* pings sent before this one, for -w */
+	uint16_t seq;
+	unsigned char used;
+};
+
+struct pendtab {
+	struct pending *slot;
+	uint16_t tail; /* oldest outstanding, when n > 0 */
+	uint16_t head; /* one past the newest */
+	unsigned n;
+};
+
+/*
+ * Returns -1 on error, with errno set.
+ */
+int
+pendinit(struct pendtab *pt);
+
+void
+pendfini(struct pendtab *pt);
+
+/*
+ * Record a ping sent. If seq is still outstanding from the previous time
+ * round the sequence space, that is replaced; the caller is expected to
+ * have dealt with it first. Returns the entry recorded.
+ */
+struct pending *
+pendadd(struct pendtab *pt, uint16_t seq, int64_t t);
+
+/*
+ * Return the outstanding ping for seq, or NULL if there is none.
+ */
+struct pending *
+pendfind(struct pendtab *pt, uint16_t seq);
+
+/*
+ * Return the oldest outstanding ping, or NULL if there are none.
+ */
+struct pending *
+pendoldest(struct pendtab *pt);
+
+/*
+ * Forget an outstanding ping, once answered or timed out.
+ */
+void
+pendremove(struct pendtab *pt, struct pending *p);
+
+#endif
+
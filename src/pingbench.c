@@ -0,0 +1,214 @@
+/*
+ * Microbenchmark for building and validating ping messages; see common.h.
+ *
+ * Each routine is run back to back for the given number of iterations,
+ * and the mean time per call is printed. With -c, each checksum kernel
+ * (see cksum.h) is run instead, and its throughput printed per buffer size.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "cksum.h"
+#include "clock.h"
+
+#define ITERATIONS 1000000
+
+/* bytes checksummed per kernel and buffer size, for -c */
+#define CK_BYTES (1 << 26)
+
+/* results are folded in here, so that no call can be optimised away */
+volatile unsigned sink;
+
+static void
+report(const char *name, int64_t start, long n)
+{
+	printf("%-10s %8.1f ns\n", name, (clocknow() - start) / (double) n);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pingbench [ -c ] [ -n <iterations> ]\n");
+}
+
+/*
+ * Throughput of each checksum kernel, in GB/s, over buffers of each size
+ * in turn. The buffer is reused, and so is in cache up to its size.
+ */
+static int
+benchkerns(void)
+{
+	static const size_t sizes[] = { 64, 1500, 9000, 65536, 1 << 20 };
+	const struct cksumkern *k;
+	uint8_t *buf;
+	size_t i, j, nk;
+
+	buf = malloc(sizes[sizeof sizes / sizeof *sizes - 1]);
+	if (buf == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	mkpayload(buf, sizes[sizeof sizes / sizeof *sizes - 1], 0);
+
+	k = cksumkerns(&nk);
+
+	printf("%-14s", "GB/s");
+	for (j = 0; j < sizeof sizes / sizeof *sizes; j++) {
+		printf(" %9zu", sizes[j]);
+	}
+	printf("\n");
+
+	for (i = 0; i < nk; i++) {
+		printf("%-14s", k[i].name);
+
+		if (!k[i].supported()) {
+			printf(" unsupported\n");
+			continue;
+		}
+
+		for (j = 0; j < sizeof sizes / sizeof *sizes; j++) {
+			int64_t start;
+			long m, n;
+
+			n = CK_BYTES / sizes[j];
+
+			start = clocknow();
+			for (m = 0; m < n; m++) {
+				if (k[i].f32 != NULL) {
+					struct f32 f;
+
+					memset(&f, 0, sizeof f);
+					k[i].f32(&f, buf, sizes[j]);
+					sink += f32sum(&f);
+				} else {
+					sink += k[i].crc(0, buf, sizes[j]);
+				}
+			}
+
+			/* bytes per ns is GB/s */
+			printf(" %9.2f", n * (double) sizes[j] / (clocknow() - start));
+		}
+
+		printf("\n");
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	char ping[PING_LEN + 1];
+	char stamped[PING_LEN + 1];
+	char ping2[PING2_LEN];
+	struct ping2 p;
+	int64_t start;
+	long i, n;
+	int kerns;
+
+	n = ITERATIONS;
+	kerns = 0;
+
+	{
+		int c;
+
+		while ((c = getopt(argc, argv, "chn:")) != -1) {
+			switch (c) {
+			case 'c':
+				kerns = 1;
+				break;
+
+			case 'n':
+				n = atol(optarg);
+				if (n <= 0) {
+					fprintf(stderr, "Invalid iteration count\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case '?':
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+		argc -= optind;
+		argv += optind;
+	}
+
+	if (0 != argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (kerns) {
+		return benchkerns() == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	start = clocknow();
+	for (i = 0; i < n; i++) {
+		sink += mkping(i)[0];
+	}
+	report("mkping", start, n);
+
+	start = clocknow();
+	for (i = 0; i < n; i++) {
+		sink += mkstamped(i, i, -i)[0];
+	}
+	report("mkstamped", start, n);
+
+	strcpy(ping, mkping(1));
+	strcpy(stamped, mkstamped(2, 3, 4));
+
+	start = clocknow();
+	for (i = 0; i < n; i++) {
+		uint16_t seq;
+
+		sink += validate(ping, &seq);
+		sink += seq;
+	}
+	report("validate", start, n);
+
+	start = clocknow();
+	for (i = 0; i < n; i++) {
+		int64_t a, b;
+
+		sink += getstamps(stamped, &a, &b);
+		sink += a + b;
+	}
+	report("getstamps", start, n);
+
+	memset(&p, 0, sizeof p);
+	p.flags = PING2_STAMPS;
+
+	start = clocknow();
+	for (i = 0; i < n; i++) {
+		p.seq = i;
+		p.tx  = i;
+		sink += mkping2(ping2, &p);
+	}
+	report("mkping2", start, n);
+
+	start = clocknow();
+	for (i = 0; i < n; i++) {
+		sink += getping2(ping2, sizeof ping2, &p);
+		sink += p.seq;
+	}
+	report("getping2", start, n);
+
+	return EXIT_SUCCESS;
+}
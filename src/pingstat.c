@@ -0,0 +1,315 @@
+/*
+ * Offline analysis of a capture written by dgping or stping -w.
+ *
+ * The capture is mapped and read in a single pass, in the order written.
+ * Round-trip times go into a histogram (see hist.h), so memory does not
+ * grow with the length of the capture, except for one bit per ping sent,
+ * to find runs of consecutive pings lost.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "clock.h"
+#include "hist.h"
+#include "capture.h"
+
+struct counts {
+	uint64_t status[CAP_UNMATCHED + 1];
+	struct hist rtt;
+};
+
+/* a bit for each ping sent, set if lost, indexed by caprec.n */
+struct lost {
+	unsigned char *bit;
+	size_t size;
+	uint64_t max;
+};
+
+static void
+count(struct counts *c, const struct caprec *r)
+{
+	assert(c != NULL);
+	assert(r != NULL);
+	assert(r->status <= CAP_UNMATCHED);
+
+	c->status[r->status]++;
+
+	if (r->status == CAP_REPLY && r->recv >= r->sent) {
+		histadd(&c->rtt, r->recv - r->sent);
+	}
+}
+
+static int
+setlost(struct lost *l, uint64_t n)
+{
+	assert(l != NULL);
+
+	if (n / 8 >= l->size) {
+		unsigned char *tmp;
+		size_t size;
+
+		size = l->size == 0 ? 4096 : l->size;
+		while (n / 8 >= size) {
+			size *= 2;
+		}
+
+		tmp = realloc(l->bit, size);
+		if (tmp == NULL) {
+			return -1;
+		}
+
+		memset(tmp + l->size, 0, size - l->size);
+
+		l->bit  = tmp;
+		l->size = size;
+	}
+
+	l->bit[n / 8] |= 1U << (n % 8);
+
+	if (n > l->max) {
+		l->max = n;
+	}
+
+	return 0;
+}
+
+static double
+loss(const struct counts *c)
+{
+	uint64_t resolved;
+
+	resolved = c->status[CAP_REPLY] + c->status[CAP_TIMEOUT];
+	if (resolved == 0) {
+		return 0.0;
+	}
+
+	return c->status[CAP_TIMEOUT] * 100.0 / resolved;
+}
+
+static void
+printwindow(const struct counts *c, int64_t start)
+{
+	printf("%.3f s: %llu answered, %llu timed out, %.1f%% loss",
+		start / (double) NS_PER_SEC,
+		(unsigned long long) c->status[CAP_REPLY],
+		(unsigned long long) c->status[CAP_TIMEOUT],
+		loss(c));
+
+	if (c->rtt.n > 0) {
+		printf(", p50/p99/max = %.3f/%.3f/%.3f ms",
+			nstoms(histpct(&c->rtt, 50)), nstoms(histpct(&c->rtt, 99)),
+			nstoms(c->rtt.max));
+	}
+
+	printf("\n");
+}
+
+static void
+printruns(const struct lost *l)
+{
+	uint64_t runs, total;
+	uint32_t longest, run;
+	uint64_t i;
+
+	runs = 0;
+	total = 0;
+	longest = 0;
+	run = 0;
+
+	for (i = 0; l->size > 0 && i <= l->max + 1; i++) {
+		int set;
+
+		/* a whole byte clear, outside a run, is skipped at once */
+		if (run == 0 && i % 8 == 0 && i / 8 < l->size && l->bit[i / 8] == 0) {
+			i += 7;
+			continue;
+		}
+
+		set = i <= l->max && (l->bit[i / 8] & (1U << (i % 8)));
+
+		if (set) {
+			run++;
+			continue;
+		}
+
+		if (run > 0) {
+			runs++;
+			total += run;
+			if (run > longest) {
+				longest = run;
+			}
+			run = 0;
+		}
+	}
+
+	if (runs == 0) {
+		printf("loss runs: none\n");
+		return;
+	}
+
+	printf("loss runs: %llu, longest %lu, mean %.2f pings\n",
+		(unsigned long long) runs, (unsigned long) longest,
+		total / (double) runs);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pingstat [ -t <seconds> ] <file>\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct counts total, win;
+	struct lost lost;
+	const struct caprec *r;
+	const struct caphdr *h;
+	int64_t width, wstart, first, last;
+	struct stat st;
+	size_t i, n;
+	void *p;
+	int fd;
+
+	width = 0;
+
+	{
+		int c;
+
+		while ((c = getopt(argc, argv, "ht:")) != -1) {
+			switch (c) {
+			case 't':
+				width = sectons(atof(optarg));
+				if (width <= 0) {
+					fprintf(stderr, "Invalid time series interval\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case '?':
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+		argc -= optind;
+		argv += optind;
+	}
+
+	if (1 != argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd == -1) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (-1 == fstat(fd, &st)) {
+		perror("fstat");
+		return EXIT_FAILURE;
+	}
+
+	if ((size_t) st.st_size < sizeof *h) {
+		fprintf(stderr, "%s: not a capture\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	(void) posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	if (-1 == capcheck(p, st.st_size, &n)) {
+		fprintf(stderr, "%s: not a capture, or of another version\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	h = p;
+	r = (const struct caprec *) (h + 1);
+
+	memset(&lost, 0, sizeof lost);
+
+	first = n > 0 ? r[0].recv : 0;
+	last  = n > 0 ? r[n - 1].recv : 0;
+	wstart = first;
+
+	for (i = 0; i < n; i++) {
+		if (r[i].status > CAP_UNMATCHED) {
+			fprintf(stderr, "%s: record %zu: unrecognised status %u\n",
+				argv[0], i, (unsigned) r[i].status);
+			return EXIT_FAILURE;
+		}
+
+		/* records are in the order resolved, and so windows close in turn */
+		while (width != 0 && r[i].recv >= wstart + width) {
+			printwindow(&win, wstart - first);
+			memset(&win, 0, sizeof win);
+			wstart += width;
+		}
+
+		count(&total, &r[i]);
+
+		if (width != 0) {
+			count(&win, &r[i]);
+		}
+
+		if (r[i].status == CAP_TIMEOUT && -1 == setlost(&lost, r[i].n)) {
+			perror("realloc");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (width != 0 && n > 0) {
+		printwindow(&win, wstart - first);
+		printf("\n");
+	}
+
+	printf("%s: %zu records over %.3f s, %.3f ms between pings\n",
+		argv[0], n, (last - first) / (double) NS_PER_SEC, nstoms(h->interval));
+
+	printf("%llu answered, %llu timed out, %llu invalid, %llu unmatched, %.1f%% loss\n",
+		(unsigned long long) total.status[CAP_REPLY],
+		(unsigned long long) total.status[CAP_TIMEOUT],
+		(unsigned long long) total.status[CAP_INVALID],
+		(unsigned long long) total.status[CAP_UNMATCHED],
+		loss(&total));
+
+	if (total.rtt.n > 0) {
+		printf("round-trip min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f ms\n",
+			nstoms(total.rtt.min), total.rtt.mean / NS_PER_MS,
+			nstoms(total.rtt.max), histstddev(&total.rtt) / NS_PER_MS);
+
+		printf("round-trip p50/p90/p99/p99.9/p99.99 = %.3f/%.3f/%.3f/%.3f/%.3f ms\n",
+			nstoms(histpct(&total.rtt, 50)), nstoms(histpct(&total.rtt, 90)),
+			nstoms(histpct(&total.rtt, 99)), nstoms(histpct(&total.rtt, 99.9)),
+			nstoms(histpct(&total.rtt, 99.99)));
+	}
+
+	printruns(&lost);
+
+	free(lost.bit);
+	(void) munmap(p, st.st_size);
+	close(fd);
+
+	return EXIT_SUCCESS;
+}
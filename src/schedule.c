@@ -0,0 +1,247 @@
+/*
+ * Send schedules. See schedule.h.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+
+#include "clock.h"
+#include "schedule.h"
+
+/* one burst may not reuse a sequence number still outstanding */
+#define MAX_BURST 65536
+
+/*
+ * xorshift64*; the quality needed here is modest, and this is the same
+ * on every platform.
+ */
+static uint64_t
+rngnext(uint64_t *x)
+{
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+
+	return *x * UINT64_C(2685821657736338717);
+}
+
+/* uniform on (0, 1] */
+static double
+rngunit(uint64_t *x)
+{
+	return ((rngnext(x) >> 11) + 1) / 9007199254740992.0;
+}
+
+static int
+loadtrace(struct schedule *sc, const char *path)
+{
+	size_t size;
+	double sec;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	sc->trace  = NULL;
+	sc->ntrace = 0;
+	size = 0;
+
+	while (1 == fscanf(f, "%lf", &sec)) {
+		int64_t t;
+
+		t = sectons(sec);
+
+		if (sec < 0 || (sc->ntrace > 0 && t < sc->trace[sc->ntrace - 1])) {
+			fprintf(stderr, "%s: offsets must not be negative, nor decrease\n", path);
+			goto error;
+		}
+
+		if (sc->ntrace == size) {
+			int64_t *tmp;
+
+			size = size == 0 ? 256 : size * 2;
+
+			tmp = realloc(sc->trace, size * sizeof *tmp);
+			if (tmp == NULL) {
+				perror("realloc");
+				goto error;
+			}
+
+			sc->trace = tmp;
+		}
+
+		sc->trace[sc->ntrace++] = t;
+	}
+
+	if (ferror(f) || !feof(f)) {
+		fprintf(stderr, "%s: expected an offset in seconds\n", path);
+		goto error;
+	}
+
+	if (sc->ntrace == 0) {
+		fprintf(stderr, "%s: no offsets\n", path);
+		goto error;
+	}
+
+	fclose(f);
+
+	return 0;
+
+error:
+
+	free(sc->trace);
+	sc->trace = NULL;
+	fclose(f);
+
+	return -1;
+}
+
+/* See schedule.h */
+int
+schedparse(struct schedule *sc, const char *spec, int64_t interval)
+{
+	assert(sc != NULL);
+	assert(spec != NULL);
+	assert(interval > 0);
+
+	memset(sc, 0, sizeof *sc);
+
+	sc->interval = interval;
+
+	sc->rng = (uint64_t) clockreal() | 1;
+
+	if (0 == strcmp(spec, "constant")) {
+		sc->kind = SEND_CONSTANT;
+		return 0;
+	}
+
+	if (0 == strcmp(spec, "poisson")) {
+		sc->kind = SEND_POISSON;
+		return 0;
+	}
+
+	if (0 == strncmp(spec, "burst:", 6)) {
+		const char *p = spec + 6;
+		unsigned long l;
+		char *ep;
+
+		errno = 0;
+		l = strtoul(p, &ep, 10);
+		if (ep == p || *ep || errno == ERANGE || l == 0 || l > MAX_BURST) {
+			fprintf(stderr, "Invalid burst size; expected 1 to %d\n", MAX_BURST);
+			return -1;
+		}
+
+		sc->kind  = SEND_BURST;
+		sc->burst = l;
+
+		return 0;
+	}
+
+	if (0 == strncmp(spec, "trace:", 6)) {
+		sc->kind = SEND_TRACE;
+		return loadtrace(sc, spec + 6);
+	}
+
+	fprintf(stderr, "Invalid schedule; expected constant, poisson, burst:N or trace:FILE\n");
+
+	return -1;
+}
+
+/* See schedule.h */
+void
+schedfini(struct schedule *sc)
+{
+	assert(sc != NULL);
+
+	free(sc->trace);
+}
+
+/* See schedule.h */
+int64_t
+schedfirst(struct schedule *sc, int64_t start)
+{
+	assert(sc != NULL);
+
+	sc->start = start;
+	sc->n = 1;
+	sc->i = 0;
+
+	if (sc->kind == SEND_TRACE) {
+		return start + sc->trace[0];
+	}
+
+	return start;
+}
+
+/* See schedule.h */
+int64_t
+schednext(struct schedule *sc, int64_t prev)
+{
+	assert(sc != NULL);
+
+	switch (sc->kind) {
+	case SEND_CONSTANT:
+		return prev + sc->interval;
+
+	case SEND_POISSON:
+		return prev + (int64_t) (-log(rngunit(&sc->rng)) * sc->interval);
+
+	case SEND_BURST:
+		if (sc->n < sc->burst) {
+			sc->n++;
+			return prev;
+		}
+
+		sc->n = 1;
+		return prev + sc->interval;
+
+	case SEND_TRACE:
+		if (sc->i + 1 >= sc->ntrace) {
+			return -1;
+		}
+
+		return sc->start + sc->trace[++sc->i];
+	}
+
+	/* NOTREACHED */
+	abort();
+}
+
+/* See schedule.h */
+double
+schedrate(const struct schedule *sc)
+{
+	assert(sc != NULL);
+
+	switch (sc->kind) {
+	case SEND_CONSTANT:
+	case SEND_POISSON:
+		return (double) NS_PER_SEC / sc->interval;
+
+	case SEND_BURST:
+		return (double) NS_PER_SEC * sc->burst / sc->interval;
+
+	case SEND_TRACE:
+		if (sc->ntrace < 2 || sc->trace[sc->ntrace - 1] == sc->trace[0]) {
+			return 0;
+		}
+
+		return (double) NS_PER_SEC * (sc->ntrace - 1)
+			/ (sc->trace[sc->ntrace - 1] - sc->trace[0]);
+	}
+
+	/* NOTREACHED */
+	abort();
+}
+
@@ -0,0 +1,72 @@
+/*
+ * Send schedules for dgping and stping.
+ *
+ * A schedule gives the absolute deadline of each ping in turn (see clock.h):
+ *
+ *   constant     every interval
+ *   poisson      exponentially distributed gaps, averaging the interval,
+ *                so that samples see the path as a random observer would
+ *   burst:N      N back-to-back every interval
+ *   trace:FILE   at offsets from the start given in FILE, in seconds,
+ *                one after another and not decreasing
+ */
+
+#ifndef DG_SCHEDULE_H
+#define DG_SCHEDULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct schedule {
+	enum {
+		SEND_CONSTANT,
+		SEND_POISSON,
+		SEND_BURST,
+		SEND_TRACE
+	} kind;
+
+	int64_t interval;
+	int64_t start;
+
+	unsigned burst; /* for SEND_BURST */
+	unsigned n;     /* sent so far in this burst */
+
+	int64_t *trace; /* for SEND_TRACE */
+	size_t ntrace;
+	size_t i;
+
+	uint64_t rng;   /* for SEND_POISSON */
+};
+
+/*
+ * Parse a schedule as given to -S, with the interval given to -i.
+ * Returns -1 on error, having printed a diagnostic.
+ */
+int
+schedparse(struct schedule *sc, const char *spec, int64_t interval);
+
+void
+schedfini(struct schedule *sc);
+
+/*
+ * The deadline for the first ping, when starting at start. Returns -1 if
+ * there are to be none.
+ */
+int64_t
+schedfirst(struct schedule *sc, int64_t start);
+
+/*
+ * The deadline for the ping after one due at prev. Returns -1 if the
+ * schedule has ended.
+ */
+int64_t
+schednext(struct schedule *sc, int64_t prev);
+
+/*
+ * The mean rate requested, in pings per second.
+ */
+double
+schedrate(const struct schedule *sc);
+
+#endif
+
@@ -0,0 +1,155 @@
+/*
+ * Pings awaiting a response, kept as a bit each. See seen.h.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "seen.h"
+
+#define BIT(st, seq) ((st)->bit[(seq) % SEEN_BITS / 8])
+#define MASK(seq)    (1U << (seq) % 8)
+
+/* See seen.h */
+int
+seeninit(struct seentab *st, int64_t timeout)
+{
+	assert(st != NULL);
+	assert(timeout >= 0);
+
+	st->bit = calloc(SEEN_BITS / 8, 1);
+	if (st->bit == NULL) {
+		return -1;
+	}
+
+	st->lo  = 0;
+	st->hi  = 0;
+	st->out = 0;
+
+	st->timeout = timeout;
+	st->start   = 0;
+	st->mtail   = 0;
+	st->mn      = 0;
+
+	return 0;
+}
+
+/* See seen.h */
+void
+seenfini(struct seentab *st)
+{
+	assert(st != NULL);
+
+	free(st->bit);
+}
+
+/* See seen.h */
+void
+seenadd(struct seentab *st, uint64_t seq, int64_t t)
+{
+	struct seenmark *m;
+
+	assert(st != NULL);
+	assert(seq == st->hi);
+	assert(st->hi - st->lo < SEEN_BITS);
+	assert(!(BIT(st, seq) & MASK(seq)));
+
+	st->hi++;
+	st->out++;
+
+	/* the newest mark is moved on, until its span is used up */
+	if (st->mn > 0 && (t - st->start < st->timeout / SEEN_GRAIN || st->mn == SEEN_MARKS)) {
+		m = &st->mark[(st->mtail + st->mn - 1) % SEEN_MARKS];
+	} else {
+		m = &st->mark[(st->mtail + st->mn) % SEEN_MARKS];
+		st->start = t;
+		st->mn++;
+	}
+
+	m->seq = seq;
+	m->t   = t;
+}
+
+/* See seen.h */
+enum seenstatus
+seenreply(struct seentab *st, uint64_t seq)
+{
+	assert(st != NULL);
+
+	if (seq < st->lo || seq >= st->hi) {
+		return SEEN_STALE;
+	}
+
+	if (BIT(st, seq) & MASK(seq)) {
+		return SEEN_DUPLICATE;
+	}
+
+	BIT(st, seq) |= MASK(seq);
+	st->out--;
+
+	return SEEN_ANSWERED;
+}
+
+/* See seen.h */
+int
+seenexpire(struct seentab *st, int64_t now, uint64_t *seq)
+{
+	assert(st != NULL);
+	assert(seq != NULL);
+
+	while (st->lo < st->hi) {
+		/* answered, and so passed over; each bit is visited once */
+		if (BIT(st, st->lo) & MASK(st->lo)) {
+			BIT(st, st->lo) &= ~MASK(st->lo);
+			st->lo++;
+			continue;
+		}
+
+		while (st->mn > 0 && st->mark[st->mtail].seq < st->lo) {
+			st->mtail = (st->mtail + 1) % SEEN_MARKS;
+			st->mn--;
+		}
+
+		/* the newest mark covers the newest ping, so one remains */
+		assert(st->mn > 0);
+
+		if (st->hi - st->lo < SEEN_BITS && now - st->mark[st->mtail].t < st->timeout) {
+			return 0;
+		}
+
+		*seq = st->lo++;
+		st->out--;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* See seen.h */
+int
+seennext(const struct seentab *st, int64_t *t)
+{
+	unsigned i;
+
+	assert(st != NULL);
+	assert(t != NULL);
+
+	if (st->out == 0) {
+		return 0;
+	}
+
+	/* marks behind lo are left for seenexpire() to drop */
+	for (i = 0; i < st->mn; i++) {
+		const struct seenmark *m;
+
+		m = &st->mark[(st->mtail + i) % SEEN_MARKS];
+		if (m->seq >= st->lo) {
+			*t = m->t + st->timeout;
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Pings awaiting a response, for dgping and stping -e, where each reply
+ * carries everything known about its ping (see struct echo in common.h).
+ *
+ * All that is kept is a bit per ping in a window of recent sequence
+ * numbers, set once answered, to tell loss and duplicates apart; and a
+ * few marks of when pings were sent, by which unanswered pings are timed
+ * out. A reply costs the same however many pings are outstanding.
+ *
+ * A ping is given up on between timeout and timeout + timeout / SEEN_GRAIN
+ * after it was sent, or when the window moves past it.
+ */
+
+#ifndef DG_SEEN_H
+#define DG_SEEN_H
+
+#include <stdint.h>
+
+#define SEEN_BITS  (UINT16_MAX + 1UL)
+#define SEEN_GRAIN 16
+#define SEEN_MARKS (2 * SEEN_GRAIN)
+
+enum seenstatus {
+	SEEN_ANSWERED,  /* the first reply to a ping outstanding */
+	SEEN_DUPLICATE, /* a further reply to a ping outstanding */
+	SEEN_STALE      /* a ping already given up on, or never sent */
+};
+
+/* every ping up to seq was sent by t */
+struct seenmark {
+	uint64_t seq;
+	int64_t t;
+};
+
+struct seentab {
+	unsigned char *bit; /* answered, by seq % SEEN_BITS */
+	uint64_t lo;        /* oldest not yet given up on, or passed over as answered */
+	uint64_t hi;        /* one past the newest sent */
+	uint64_t out;       /* unanswered, from lo to hi */
+
+	int64_t timeout;
+	int64_t start;      /* of the newest mark's span */
+	struct seenmark mark[SEEN_MARKS];
+	unsigned mtail;
+	unsigned mn;
+};
+
+/*
+ * Returns -1 on error, with errno set.
+ */
+int
+seeninit(struct seentab *st, int64_t timeout);
+
+void
+seenfini(struct seentab *st);
+
+/*
+ * Record a ping sent at t, which must be numbered st->hi. The caller is
+ * expected to have dealt with any ping pushed out of the window first,
+ * by seenexpire().
+ */
+void
+seenadd(struct seentab *st, uint64_t seq, int64_t t);
+
+/*
+ * Record a reply to seq.
+ */
+enum seenstatus
+seenreply(struct seentab *st, uint64_t seq);
+
+/*
+ * Give the oldest ping given up on by now, or which the next seenadd()
+ * would push out of the window. Returns 0 if there is none. Each is
+ * given once.
+ */
+int
+seenexpire(struct seentab *st, int64_t now, uint64_t *seq);
+
+/*
+ * When the oldest outstanding ping may next be given up on. Returns 0
+ * if there are none outstanding.
+ */
+int
+seennext(const struct seentab *st, int64_t *t);
+
+#endif
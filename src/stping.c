@@ -4,8 +4,8 @@
  * - Connectivity
  * - Latency
  *
- * Pending responses are stored in a simple linked list; these are removed
- * either when a response is received, or on timeout. A checksum is included
+ * Pending responses are stored in a table indexed by sequence number; these
+ * are removed either when a response is received, or on timeout. A checksum is included
  * in the packet contents to detect corruption, and a sequence number is used
  * to identify the order of responses.
  *
@@ -18,9 +18,7 @@
  * TODO: gethostbyname for argv[1]
  * TODO: any other syscalls for EINTR?
  * TODO: select can't predict the future. consider making everything non-blocking
- * TODO: i am ever suspicious about timing; confirm lengths are ok for select() loop.
  * TODO: add "don't fragment" option
- * TODO: add packet size option, filled with random data, for stress testing. checksum this, too.
  * TODO: option to dump packet contents, tcpdump style, for visualisation.
  * TODO: don't use stdint.h!
  * TODO: keep going if IP vanishes (e.g. by DHCP); i.e. send() fails
@@ -54,6 +52,14 @@
 #include <signal.h>
 
 #include "common.h"
+#include "clock.h"
+#include "tstamp.h"
+#include "busy.h"
+#include "schedule.h"
+#include "hist.h"
+#include "capture.h"
+#include "pending.h"
+#include "seen.h"
 
 /*
  * Workaround for inline assembly in glibc confusing MSan
@@ -82,38 +88,106 @@
 
 /*
  * The time to timeout pending responses, and the interval between pings.
- * Both times are given in milliseconds. The cull factor (given as a multiple
+ * Both times are given in nanoseconds. The cull factor (given as a multiple
  * of the timeout) is the length of time to wait for unanswered pings.
  */
-double timeout    = 5.0 * 1000.0;
-double interval   = 0.5 * 1000.0;
+int64_t timeout    = 5000 * NS_PER_MS;
+int64_t interval   =  500 * NS_PER_MS;
 double cullfactor = 1.25;
 
+/* when to send pings; see schedule.h */
+struct schedule sched;
+
 /* Variables for logging statistics */
 unsigned int stat_sent;
 unsigned int stat_recieved;
 unsigned int stat_timedout;
 unsigned int stat_ignored;
 
-double stat_timemax;
-double stat_timemin = DBL_MAX;
-double stat_timesum;
-double stat_timesqr;
-
-/* flags for signal handlers */
-volatile sig_atomic_t shouldexit;
-volatile sig_atomic_t shouldinfo;
-
+/* The full sequence number of the next ping, which unlike stat_sent never wraps */
+uint64_t nextseq;
+
+/* Round-trip times, in ns; see hist.h */
+struct hist stat_rtt;
+
+/* Kernel-level round-trip times, for -k */
+unsigned int stat_kcount;
+double stat_ktimemax;
+double stat_ktimemin = DBL_MAX;
+double stat_ktimesum;
+
+/* -k: kernel timestamps, and the sequence number for each ping sent */
+int ktimes;
+uint16_t txseq[PENDING_SLOTS];
+uint32_t txcount;
+
+/* the length of every ping sent, by which kernel timestamps are keyed */
+size_t msglen = PING_LEN;
+
+/* Round-trip times from when each ping was due, rather than sent */
+double stat_stimemax;
+double stat_stimemin = DBL_MAX;
+double stat_stimesum;
+
+/* When pinging began, for the times of -I reports */
+int64_t stat_start;
+
+/* When the first and latest pings were sent, for the rate achieved */
+int64_t stat_first;
+int64_t stat_last;
+
+/* Server dwell times, for -d */
+unsigned int stat_dcount;
+double stat_dtimemax;
+double stat_dtimemin = DBL_MAX;
+double stat_dtimesum;
+
+/* -I: the time between reports, and statistics for the current report window */
+int64_t report;
+struct {
+	int64_t start;
+	int64_t end;
+	unsigned int sent;
+	unsigned int recieved;
+	unsigned int timedout;
+	unsigned int ignored;
+	struct hist rtt;
+} win;
+
+/* -w: the capture file, or NULL; see capture.h */
+FILE *capf;
+
+/* -2: send version 2 messages, tagged with this session; see common.h */
+int proto2;
+uint32_t session;
+
+/* -s: bytes of pseudo-random payload carried by each version 2 message */
+size_t payload;
+
+/* -C: checksum version 2 messages by CRC-32C, rather than Fletcher-32 */
+int crc;
+char *msg;
 
 /*
- * A linked-list of unanswered ping requests.
+ * -e: take what is known of each ping from its reply, which echoes it,
+ * keeping just a bit per ping rather than a struct pending; see seen.h.
+ * The key is for each ping's nonce.
  */
-struct pending {
-	struct timeval t;
-	uint16_t seq;
+int echoed;
+uint64_t key;
+struct seentab seen;
+
+/* -d: ask the daemon for its timestamps */
+int stamps;
+
+/* -b: spin on receive; -a, -f: CPU and SCHED_FIFO priority */
+int busy;
+int cpu = -1;
+int prio;
 
-	struct pending *next;
-};
+/* flags for signal handlers */
+volatile sig_atomic_t shouldexit;
+volatile sig_atomic_t shouldinfo;
 
 static void
 sighandler(int s)
@@ -136,100 +210,104 @@ sighandler(int s)
 }
 
 /*
- * Calculate the difference a given time and the current time; a - b.
+ * For -w, record a ping resolved, or a reply which could not be matched
+ * to one, in which case p is NULL. A version 2 ping's full sequence number
+ * is its count sent, so seq is needed in full only where p is NULL.
  */
-static struct timeval
-xtimersub(struct timeval *a, struct timeval *b)
+static void
+capture(const struct pending *p, uint64_t seq, int64_t recv, size_t size,
+	enum capstatus status)
 {
-	struct timeval t;
-
-	t.tv_sec  = a->tv_sec  - b->tv_sec;
-	t.tv_usec = a->tv_usec - b->tv_usec;
+	struct caprec r;
 
-	if (t.tv_usec < 0) {
-		t.tv_sec--;
-		t.tv_usec += 1000 * 1000;
+	if (capf == NULL) {
+		return;
 	}
 
-	return t;
+	memset(&r, 0, sizeof r);
+	r.sent   = p != NULL ? p->t : 0;
+	r.n      = p != NULL ? p->n : 0;
+	r.recv   = recv;
+	r.seq    = proto2 && p != NULL ? p->n : seq;
+	r.size   = size;
+	r.status = status;
+
+	if (-1 == capwrite(capf, &r)) {
+		perror("capture");
+		exit(EXIT_FAILURE);
+	}
 }
 
 /*
- * Check validity of a timeval structure, adjusting it if necessary. This is
- * provided for convenience of inaccurate arithmetic around the limits of
- * floating point calculations, to permit ping internals at fractions of a
- * second without unnecessarily complex.error-checking around select().
- *
- * Since negative values in this program are only ever produced by floating
- * point inaccuracies, they will always be small (to the order of epsilon or
- * so), and hence are just set to 0, if present.
- *
- * See SUS3 <sys/types.h>'s specification for a discussion of valid values here.
+ * For -e, give up on pings as seenexpire() says. Only their number is
+ * known, and so nothing else is reported.
  */
 static void
-xitimerfix(struct timeval *tv)
+cullseen(int64_t now)
 {
-	assert(tv->tv_usec <= 1000000);
+	struct pending gone;
+	uint64_t n;
 
-	if (tv->tv_sec < 0) {
-		tv->tv_sec = 0;
-	}
+	while (seenexpire(&seen, now, &n)) {
+		stat_timedout++;
+		win.timedout++;
+		printf("timeout: seq=%d\n", (int) (uint16_t) n);
 
-	if (tv->tv_usec < 0) {
-		tv->tv_usec = 0;
+		memset(&gone, 0, sizeof gone);
+		gone.n = n;
+		capture(&gone, n, now, 0, CAP_TIMEOUT);
 	}
 }
 
-static struct pending **
-findpending(uint16_t seq, struct pending **p)
+static int
+sendecho(int s, struct pendtab *pt, uint16_t seq, int64_t due)
 {
-	struct pending **curr;
+	const char *buf;
+	int64_t t, w;
+	size_t len;
 
-	for (curr = p; *curr; curr = &(*curr)->next) {
-		if ((*curr)->seq == seq) {
-			return curr;
-		}
-	}
+	w = stamps ? clockreal() : 0;
 
-	return NULL;
-}
+	/* before send(), which may not return until after the reply has come */
+	t = clocknow();
 
-/*
- * Convert a timeval struct to milliseconds.
- */
-static double
-tvtoms(struct timeval *tv)
-{
-	return tv->tv_usec / 1000.0 + tv->tv_sec * 1000.0;
-}
+	if (proto2) {
+		struct ping2 p;
 
-static struct timeval
-mstotv(double ms) {
-	struct timeval tv;
+		/* seq is cut from the full sequence number */
+		seq = nextseq;
 
-	tv.tv_sec  = round(ms / 1000.0);
-	tv.tv_usec = round(fmod(ms, 1000.0) * 1000.0);
-	return tv;
-}
+		p.flags   = (stamps ? PING2_STAMPS : 0) | (crc ? PING2_CRC32C : 0);
+		p.session = session;
+		p.seq     = nextseq;
+		p.tx      = t;
+		p.srx     = 0;
+		p.stx     = 0;
+		p.len     = (echoed ? ECHO_LEN : 0) + payload;
 
-static void
-removepending(struct pending **p)
-{
-	struct pending *tmp;
+		if (echoed) {
+			struct echo e;
 
-	tmp = *p;
-	*p = (*p)->next;
-	free(tmp);
-}
+			e.due   = due;
+			e.wtx   = w;
+			e.nonce = echononce(key, p.seq, p.tx, &e);
 
-static int
-sendecho(int s, struct pending **p, uint16_t seq)
-{
-	const char *buf;
-	size_t len;
+			mkecho(msg + PING2_LEN, &e);
+		}
 
-	buf = mkping(seq);
-	len = strlen(buf);
+		mkpayload(msg + PING2_LEN + p.len - payload, payload, (uint64_t) session << 32 ^ p.seq);
+
+		len = mkping2(msg, &p);
+		buf = msg;
+	} else {
+		buf = stamps ? mkstamped(seq, w, 0) : mkping(seq);
+		len = strlen(buf);
+	}
+
+	/* a ping pushed out of the window is given up on before its number is reused */
+	if (echoed) {
+		cullseen(t);
+	}
 
 	while (len > 0) {
 		ssize_t r;
@@ -239,6 +317,10 @@ sendecho(int s, struct pending **p, uint16_t seq)
 			switch (errno) {
 			case ENOBUFS:
 			case EINTR:
+			case EAGAIN: /* nonblocking, for -b */
+#if EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK:
+#endif
 				continue;
 
 			default:
@@ -254,162 +336,476 @@ sendecho(int s, struct pending **p, uint16_t seq)
 		buf += r;
 	}
 
+	if (stat_sent == 0) {
+		stat_first = t;
+	}
+	stat_last = t;
+
 	stat_sent++;
+	nextseq++;
+	win.sent++;
 
-	/* Add this request to the list of pings pending responses */
-	{
-		struct pending *new;
+	if (echoed) {
+		seenadd(&seen, nextseq - 1, t);
+		return 0;
+	}
 
-		new = malloc(sizeof *new);
-		if (NULL == new) {
-			perror("malloc");
-			exit(EXIT_FAILURE);
-		}
+	txseq[txcount++ % PENDING_SLOTS] = seq;
 
-		if (-1 == gettimeofday(&new->t, NULL)) {
-			perror("gettimeofday");
-			exit(EXIT_FAILURE);
+	/* the sequence number has wrapped round to a ping never answered */
+	{
+		struct pending *old;
+
+		old = pendfind(pt, seq);
+		if (old != NULL) {
+			stat_timedout++;
+			win.timedout++;
+			printf("timeout: seq=%d time=%.3f ms\n", seq, nstoms(t - old->t));
+			capture(old, seq, t, 0, CAP_TIMEOUT);
+			pendremove(pt, old);
 		}
+	}
 
-		new->next = *p;
-		new->seq  = seq;
+	/* Add this request to the table of pings pending responses */
+	{
+		struct pending *p;
 
-		*p = new;
+		p = pendadd(pt, seq, t);
+		p->wtx = w;
+		p->due = due;
+		p->n   = nextseq - 1;
 	}
 
 	return 0;
 }
 
+/*
+ * Note the kernel's transmit timestamps, as they arrive on the error queue.
+ * Timestamps are keyed by the offset of the last byte of each send(); those
+ * ending part-way through a ping are of no interest.
+ */
+static void
+recvtx(int s, struct pendtab *pt)
+{
+	uint32_t id;
+	int64_t kts;
+
+	while (1 == tstx(s, &id, &kts)) {
+		struct pending *p;
+		uint32_t n;
+
+		if (kts == 0) {
+			continue;
+		}
+
+		if ((id + 1) % msglen != 0) {
+			continue;
+		}
+
+		n = (id + 1) / msglen - 1;
+
+		p = pendfind(pt, txseq[n % PENDING_SLOTS]);
+		if (p != NULL) {
+			p->ktx = kts;
+		}
+	}
+}
+
+/*
+ * Decode a reply of either version. For version 2, *n is the count of pings
+ * sent before the one answered; otherwise it is -1. *a and *b are the
+ * daemon's timestamps, or 0 if it gave none. For -e, *e is filled from what
+ * a version 2 reply echoes. Returns 0 if not valid.
+ */
 static int
-recvecho(int s, struct pending **p, struct sockaddr_in *sin)
+decode(const char *buf, size_t len, uint16_t *seq, int64_t *n,
+	int64_t *a, int64_t *b, struct pending *e)
 {
-	static char buf[3 + 5 + 24 + 2];
-	static size_t len = sizeof buf - 1;
-	struct pending **curr;
-	uint16_t seq;
-	ssize_t r;
+	size_t off;
 
-	assert(s != -1);
-	assert(p != NULL);
-	assert(sin != NULL);
+	assert(buf != NULL);
+	assert(seq != NULL);
+	assert(n != NULL);
+	assert(a != NULL && b != NULL);
+	assert(e != NULL);
 
-	r = recv(s, buf + (sizeof buf - 1 - len), len, 0);
-	if (r == -1) {
-		switch (errno) {
-		case EINTR:
+	off = echoed ? ECHO_LEN : 0;
+
+	if (isping2(buf, len)) {
+		struct ping2 p;
+
+		if (1 != getping2(buf, len, &p)) {
 			return 0;
+		}
 
-		default:
-			perror("recv");
-			return -1;
+		if (p.session != session) {
+			fprintf(stderr, "disregarding: session %08lX is not ours\n",
+				(unsigned long) p.session);
+			return 0;
 		}
-	}
 
-	if (r == 0) {
-		errno = ECONNRESET;
-		perror("recv");
-		return -1;
-	}
+		if (p.len != off + payload) {
+			fprintf(stderr, "disregarding: payload of %lu bytes, not %lu\n",
+				(unsigned long) p.len, (unsigned long) (off + payload));
+			return 0;
+		}
+
+		/* the checksum shows the reply arrived intact, this that it was echoed */
+		if (!checkpayload(buf + PING2_LEN + off, payload, (uint64_t) session << 32 ^ p.seq)) {
+			fprintf(stderr, "disregarding: payload differs from that sent, seq=%llu\n",
+				(unsigned long long) p.seq);
+			return 0;
+		}
+
+		if (echoed) {
+			struct echo ec;
+
+			getecho(buf + PING2_LEN, &ec);
+
+			if (ec.nonce != echononce(key, p.seq, p.tx, &ec)) {
+				fprintf(stderr, "disregarding: nonce mismatch, seq=%llu\n",
+					(unsigned long long) p.seq);
+				return 0;
+			}
+
+			memset(e, 0, sizeof *e);
+			e->t   = p.tx;
+			e->due = ec.due;
+			e->wtx = ec.wtx;
+			e->n   = p.seq;
+			e->seq = p.seq;
+		}
 
-	assert(r >= 1);
-	assert(r <= (ssize_t) len);
+		*seq = p.seq;
+		*n   = p.seq;
+		*a   = p.srx;
+		*b   = p.stx;
 
-	len -= r;
+		return 1;
+	}
 
-	if (len > 0) {
+	if (1 != validate(buf, seq)) {
 		return 0;
 	}
 
-	len = sizeof buf - 1;
+	*n = -1;
+
+	if (!getstamps(buf, a, b)) {
+		*a = 0;
+		*b = 0;
+	}
 
-	buf[sizeof buf - 1] = '\0';
+	return 1;
+}
+
+/*
+ * Handle one complete message, received by the kernel at krx (or 0).
+ */
+static int
+echo(const char *buf, size_t len, struct pendtab *pt, struct sockaddr_in *sin,
+	int64_t krx)
+{
+	struct pending *curr, got;
+	uint16_t seq;
+	int64_t n, a, b;
+
+	assert(buf != NULL);
+	assert(pt != NULL);
+	assert(sin != NULL);
 
 	stat_recieved++;
+	win.recieved++;
 
-	if (1 != validate(buf, &seq)) {
+	if (1 != decode(buf, len, &seq, &n, &a, &b, &got)) {
 		stat_ignored++;
+		win.ignored++;
+		capture(NULL, 0, clocknow(), len, CAP_INVALID);
 		return 0;
 	}
 
-	curr = findpending(seq, p);
+	if (echoed) {
+		/* a version 1 reply cannot be one of ours */
+		switch (n == -1 ? SEEN_STALE : seenreply(&seen, n)) {
+		case SEEN_ANSWERED:
+			curr = &got;
+			break;
+
+		case SEEN_DUPLICATE:
+			fprintf(stderr, "disregarding: duplicate reply, seq=%d\n", seq);
+			stat_ignored++;
+			win.ignored++;
+			capture(NULL, n != -1 ? (uint64_t) n : seq, clocknow(), len, CAP_UNMATCHED);
+			return 0;
+
+		case SEEN_STALE:
+		default:
+			curr = NULL;
+			break;
+		}
+	} else {
+		/* a version 2 reply may be from a previous time round the table */
+		curr = pendfind(pt, seq);
+		if (curr != NULL && n != -1 && curr->n != (uint64_t) n) {
+			curr = NULL;
+		}
+	}
+
 	if (curr == NULL) {
 		fprintf(stderr, "disregarding: sequence %d not pending response\n", seq);
 		stat_ignored++;
+		win.ignored++;
+		capture(NULL, n != -1 ? (uint64_t) n : seq, clocknow(), len, CAP_UNMATCHED);
 		return 0;
 	}
 
 	/* Calculate round-trip delta for this particular seq ID */
 	{
-		struct timeval now, dtv;
+		int64_t now, rtt;
 		double d;
 
-		if (-1 == gettimeofday(&now, NULL)) {
-			perror("gettimeofday");
-			exit(EXIT_FAILURE);
+		now = clocknow();
+		rtt = now - curr->t;
+		assert(rtt >= 0);
+
+		d = nstoms(rtt);
+
+		printf("%d bytes from %s seq=%d time=%.3f ms",
+			(int) len, inet_ntoa(sin->sin_addr), (int) seq, d);
+
+		if (krx != 0 && curr->ktx != 0) {
+			double k;
+
+			k = nstoms(krx - curr->ktx);
+
+			printf(" ktime=%.3f ms", k);
+
+			stat_kcount++;
+			stat_ktimesum += k;
+			if (k < stat_ktimemin) {
+				stat_ktimemin = k;
+			}
+			if (k > stat_ktimemax) {
+				stat_ktimemax = k;
+			}
 		}
 
-		dtv = xtimersub(&now, &(*curr)->t);
-		d = tvtoms(&dtv);
-		assert(d >= 0);
+		/* a reflecting daemon gives back our own request, with b still 0 */
+		if (stamps && b != 0) {
+			int64_t tx, rx;
+			double dw;
+
+			tx = curr->ktx != 0 ? curr->ktx : curr->wtx;
+			rx = krx != 0 ? krx : clockreal();
+
+			dw = nstoms(stampdiff(b, a));
 
-		printf("%d bytes from %s seq=%d time=%.3f ms\n",
-			(int) strlen(buf), inet_ntoa(sin->sin_addr), (int) seq, d);
+			/* one-way delays are meaningful only if the clocks agree */
+			printf(" dwell=%.3f ms fwd=%.3f ms rev=%.3f ms",
+				dw, nstoms(stampdiff(a, tx)), nstoms(stampdiff(rx, b)));
 
-		stat_timesum += d;
-		stat_timesqr += pow(d, 2);
-		if (d < stat_timemin) {
-			stat_timemin = d;
+			stat_dcount++;
+			stat_dtimesum += dw;
+			if (dw < stat_dtimemin) {
+				stat_dtimemin = dw;
+			}
+			if (dw > stat_dtimemax) {
+				stat_dtimemax = dw;
+			}
+		}
+
+		printf("\n");
+
+		histadd(&stat_rtt, rtt);
+		histadd(&win.rtt, rtt);
+
+		capture(curr, seq, now, len, CAP_REPLY);
+
+		/* including any delay in sending, which would otherwise go unseen */
+		d = nstoms(rtt + (curr->t - curr->due));
+
+		stat_stimesum += d;
+		if (d < stat_stimemin) {
+			stat_stimemin = d;
 		}
-		if (d > stat_timemax) {
-			stat_timemax = d;
+		if (d > stat_stimemax) {
+			stat_stimemax = d;
 		}
 	}
 
-	removepending(curr);
+	if (!echoed) {
+		pendremove(pt, curr);
+	}
 
 	return 1;
 }
 
 /*
- * Cull pending packets older than timeout seconds.
+ * Read everything available, and handle every complete message received
+ * so far. Returns 1 if any message was handled, or 0 for a partial read.
+ */
+static int
+recvecho(int s, struct pendtab *pt, struct sockaddr_in *sin)
+{
+	static char in[4096];
+	static struct rxbuf rx;
+	const char *q;
+	size_t len;
+	ssize_t r;
+	int any;
+
+	assert(s != -1);
+	assert(pt != NULL);
+	assert(sin != NULL);
+
+	if (rx.buf == NULL) {
+		rxinit(&rx, in, sizeof in);
+	}
+
+	/* the error queue makes the socket readable too */
+	if (ktimes) {
+		recvtx(s, pt);
+	}
+
+	r = rxfill(s, &rx, ktimes ? MSG_DONTWAIT : 0);
+	if (r == -1) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			return 0;
+
+		default:
+			perror("recv");
+			return -1;
+		}
+	}
+
+	if (r == 0) {
+		errno = ECONNRESET;
+		perror("recv");
+		return -1;
+	}
+
+	any = 0;
+
+	while (q = rxframe(&rx, &len), q != NULL) {
+		char buf[PING_LEN + 1];
+
+		/* version 1 messages are parsed as strings */
+		if (!isping2(q, len)) {
+			memcpy(buf, q, len);
+			buf[len] = '\0';
+			q = buf;
+		}
+
+		if (echo(q, len, pt, sin, rx.kts)) {
+			any = 1;
+		}
+	}
+
+	return any;
+}
+
+/*
+ * Wait up to ns for s to become readable, as select() does. With -b, this
+ * spins rather than sleeps: s is nonblocking, the caller's receive is the
+ * poll, and so s is reported readable until the time is up.
+ */
+static int
+waitrecv(int s, int64_t ns)
+{
+	struct timeval tv;
+	fd_set rfds;
+
+	if (busy && s != -1) {
+		return ns > 0;
+	}
+
+	tv = nstotv(ns);
+
+	FD_ZERO(&rfds);
+	if (s != -1) {
+		FD_SET(s, &rfds);
+	}
+
+	return select(s + 1, &rfds, NULL, NULL, &tv);
+}
+
+/*
+ * Cull pending packets older than the timeout. These are in the order sent,
+ * so only those which have expired need be visited.
  */
 static void
-culltimeouts(struct pending **p)
+culltimeouts(struct pendtab *pt, int64_t now)
 {
-	struct pending **curr;
-	struct pending **next;
-	struct timeval now;
+	struct pending *curr;
 
-	if (-1 == gettimeofday(&now, NULL)) {
-		perror("gettimeofday");
-		exit(EXIT_FAILURE);
+	if (echoed) {
+		cullseen(now);
+		return;
 	}
 
-	for (curr = p; *curr; curr = next) {
-		struct timeval dtv;
-		double d;
+	while (curr = pendoldest(pt), curr != NULL) {
+		if (now - curr->t < timeout) {
+			break;
+		}
 
-		dtv = xtimersub(&now, &(*curr)->t);
-		d = tvtoms(&dtv);
-		if (d > timeout) {
-			stat_timedout++;
-			printf("timeout: seq=%d time=%.3f ms\n", (*curr)->seq, d);
-			removepending(curr);
-			next = curr;
-		} else {
-			next = &(*curr)->next;
+		stat_timedout++;
+		win.timedout++;
+		printf("timeout: seq=%d time=%.3f ms\n", curr->seq, nstoms(now - curr->t));
+		capture(curr, curr->seq, now, 0, CAP_TIMEOUT);
+		pendremove(pt, curr);
+	}
+}
+
+/*
+ * The time from now until the oldest pending packet times out. Returns 0
+ * if there are none pending.
+ */
+static int
+nextexpiry(struct pendtab *pt, int64_t now, int64_t *ns)
+{
+	struct pending *oldest;
+
+	if (echoed) {
+		int64_t t;
+
+		if (!seennext(&seen, &t)) {
+			return 0;
+		}
+
+		*ns = t - now;
+		if (*ns < 0) {
+			*ns = 0;
 		}
+
+		return 1;
 	}
+
+	oldest = pendoldest(pt);
+	if (oldest == NULL) {
+		return 0;
+	}
+
+	*ns = oldest->t + timeout - now;
+	if (*ns < 0) {
+		*ns = 0;
+	}
+
+	return 1;
 }
 
 static void
 printstats(FILE *f, int multiline)
 {
-	double avg;
-	double variance;
-
 	assert(f != NULL);
 
+	if (multiline) {
+		fprintf(f, "%lu bytes per message\n", (unsigned long) msglen);
+	}
+
 	fprintf(f, multiline ? "%u transmitted, "
 	                       "%u received, "
 	                       "%u timed out, "
@@ -422,7 +818,7 @@ printstats(FILE *f, int multiline)
 		stat_sent, stat_recieved, stat_timedout, stat_ignored,
 		(stat_sent - stat_recieved) * 100.0 / stat_sent);
 
-	if (stat_recieved == 0 || stat_sent - stat_timedout == 0) {
+	if (stat_rtt.n == 0) {
 		fprintf(f, "\n");
 		return;
 	}
@@ -431,27 +827,102 @@ printstats(FILE *f, int multiline)
 	                       "round-trip "
 	                     : ", ");
 
-	/* Calculate statistics */
-	avg = stat_timesum / stat_recieved;
+	fprintf(f, "min/avg/max/stddev = "
+		   "%.3f/%.3f/%.3f/%.3f ms",
+		nstoms(stat_rtt.min), stat_rtt.mean / NS_PER_MS, nstoms(stat_rtt.max),
+		histstddev(&stat_rtt) / NS_PER_MS);
 
-	if (stat_recieved == 1) {
-		fprintf(f, "min/avg/max = "
-			   "%.3f/%.3f/%.3f\n",
-			stat_timemin, avg, stat_timemax);
-	} else {
-		variance = (stat_timesqr - stat_recieved * pow(avg, 2))
-			/ (stat_recieved - 1);
+	fprintf(f, multiline ? "\n"
+	                       "round-trip "
+	                     : ", ");
 
-		fprintf(f, "min/avg/max/stddev = "
-			   "%.3f/%.3f/%.3f/%.3f ms\n",
-			stat_timemin, avg, stat_timemax, sqrt(variance));
+	fprintf(f, "p50/p90/p99/p99.9/p99.99 = "
+		   "%.3f/%.3f/%.3f/%.3f/%.3f ms\n",
+		nstoms(histpct(&stat_rtt, 50)), nstoms(histpct(&stat_rtt, 90)),
+		nstoms(histpct(&stat_rtt, 99)), nstoms(histpct(&stat_rtt, 99.9)),
+		nstoms(histpct(&stat_rtt, 99.99)));
+
+	fprintf(f, "%sscheduled min/avg/max = %.3f/%.3f/%.3f ms\n",
+		multiline ? "round-trip " : "",
+		stat_stimemin, stat_stimesum / stat_rtt.n, stat_stimemax);
+
+	if (stat_kcount > 0) {
+		fprintf(f, "%skernel min/avg/max = %.3f/%.3f/%.3f ms\n",
+			multiline ? "round-trip " : "",
+			stat_ktimemin, stat_ktimesum / stat_kcount, stat_ktimemax);
+	}
+
+	if (stat_dcount > 0) {
+		fprintf(f, "%sserver dwell min/avg/max = %.3f/%.3f/%.3f ms\n",
+			multiline ? "round-trip " : "",
+			stat_dtimemin, stat_dtimesum / stat_dcount, stat_dtimemax);
+	}
+
+	if (stat_sent > 1 && stat_last > stat_first) {
+		fprintf(f, "%srate achieved/requested = %.3f/%.3f per second\n",
+			multiline ? "send " : "",
+			(stat_sent - 1) * (double) NS_PER_SEC / (stat_last - stat_first),
+			schedrate(&sched));
+	}
+}
+
+/*
+ * Print statistics for the window since the last report, with running
+ * totals, and start the next window. Loss is taken over the pings
+ * resolved (answered or timed out) in each window, so that pings still
+ * in flight at the edges of a window are not counted as lost.
+ */
+static void
+printreport(FILE *f, int64_t now)
+{
+	uint64_t resolved;
+	int64_t start;
+
+	assert(f != NULL);
+	assert(report > 0);
+
+	resolved = win.rtt.n + win.timedout;
+
+	fprintf(f, "%.3f-%.3f s: %u/%u packets, %u timed out, %u disregarded, %.1f%% loss",
+		(win.start - stat_start) / (double) NS_PER_SEC,
+		(win.end - stat_start) / (double) NS_PER_SEC,
+		win.sent, win.recieved, win.timedout, win.ignored,
+		resolved == 0 ? 0.0 : win.timedout * 100.0 / resolved);
+
+	if (win.rtt.n > 0) {
+		fprintf(f, ", p50/p90/p99/max = %.3f/%.3f/%.3f/%.3f ms",
+			nstoms(histpct(&win.rtt, 50)), nstoms(histpct(&win.rtt, 90)),
+			nstoms(histpct(&win.rtt, 99)), nstoms(win.rtt.max));
+	}
+
+	resolved = stat_rtt.n + stat_timedout;
+
+	fprintf(f, "; total %u/%u packets, %.1f%% loss",
+		stat_sent, stat_recieved,
+		resolved == 0 ? 0.0 : stat_timedout * 100.0 / resolved);
+
+	if (stat_rtt.n > 0) {
+		fprintf(f, ", p99 = %.3f ms",
+			nstoms(histpct(&stat_rtt, 99)));
+	}
+
+	fprintf(f, "\n");
+
+	/* if reports have fallen behind, the next window covers the gap */
+	start = win.end;
+	memset(&win, 0, sizeof win);
+	win.start = start;
+	win.end = start + report;
+	while (win.end <= now) {
+		win.end += report;
 	}
 }
 
 static void
 usage(void) {
-	fprintf(stderr, "usage: stping [ -i <interval> ] [ -t <timeout> ] [ -u <cullfactor> ]\n"
-		"\t[ -c <count> ] <address> <port>\n");
+	fprintf(stderr, "usage: stping [ -2 ] [ -C ] [ -e ] [ -b ] [ -a <cpu> ] [ -f <priority> ] [ -d ] [ -k ] [ -I <interval> ]\n"
+		"\t[ -i <interval> ] [ -S <schedule> ] [ -t <timeout> ] [ -u <cullfactor> ] [ -c <count> ]\n"
+		"\t[ -s <bytes> ] [ -w <file> ] <address> <port>\n");
 }
 
 int
@@ -459,9 +930,11 @@ main(int argc, char **argv)
 {
 	int s;
 	int count;
-	struct pending *p;
+	struct pendtab pt;
 	struct sockaddr_in sin;
 	struct sigaction sigact;
+	const char *schedspec;
+	const char *capfile;
 	sigset_t set;
 	int status;
 
@@ -476,13 +949,58 @@ main(int argc, char **argv)
 	sigact.sa_mask    = set;
 	sigact.sa_flags   = 0;
 
+	schedspec = "constant";
+	capfile = NULL;
+
 	/* Handle CLI options */
 	count = 0;
 	{
 		int c;
 
-		while ((c = getopt(argc, argv, "hc:i:t:u:")) != -1) {
+		while ((c = getopt(argc, argv, "2Ca:bc:def:hi:I:kS:s:w:t:u:")) != -1) {
 			switch (c) {
+			case 'a':
+				cpu = atoi(optarg);
+				if (cpu < 0 || optarg[strspn(optarg, "0123456789")]) {
+					fprintf(stderr, "Invalid CPU\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'b':
+				busy = 1;
+				break;
+
+			case 'f':
+				prio = atoi(optarg);
+				if (prio <= 0 || optarg[strspn(optarg, "0123456789")]) {
+					fprintf(stderr, "Invalid priority\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'd':
+				stamps = 1;
+				break;
+
+			case '2':
+				proto2 = 1;
+				break;
+
+			case 'C':
+				crc = 1;
+				proto2 = 1;
+				break;
+
+			case 'e':
+				echoed = 1;
+				proto2 = 1;
+				break;
+
+			case 'k':
+				ktimes = 1;
+				break;
+
 			case 'c':
 				count = atoi(optarg);
 				if (count <= 0 || optarg[strspn(optarg, "0123456789")]) {
@@ -492,16 +1010,16 @@ main(int argc, char **argv)
 				break;
 
 			case 'i':
-				interval = atof(optarg) * 1000.0;
-				if (interval < DBL_EPSILON || interval < 0.001) {
+				interval = sectons(atof(optarg));
+				if (interval < NS_PER_US) {
 					fprintf(stderr, "Invalid ping interval\n");
 					return EXIT_FAILURE;
 				}
 				break;
 
 			case 't':
-				timeout = atof(optarg) * 1000.0;
-				if (timeout <= DBL_EPSILON && optarg[strspn(optarg, "0.")]) {
+				timeout = sectons(atof(optarg));
+				if (timeout <= 0 && optarg[strspn(optarg, "0.")]) {
 					fprintf(stderr, "Invalid ping timeout\n");
 					return EXIT_FAILURE;
 				}
@@ -515,6 +1033,33 @@ main(int argc, char **argv)
 				}
 				break;
 
+			case 'S':
+				schedspec = optarg;
+				break;
+
+			case 's':
+				payload = strtoul(optarg, NULL, 10);
+				if (payload > STREAM_MAXLEN - PING2_LEN || optarg[strspn(optarg, "0123456789")]) {
+					fprintf(stderr, "Invalid payload size; at most %d bytes\n",
+						STREAM_MAXLEN - PING2_LEN);
+					return EXIT_FAILURE;
+				}
+				/* only version 2 messages carry a payload */
+				proto2 = 1;
+				break;
+
+			case 'w':
+				capfile = optarg;
+				break;
+
+			case 'I':
+				report = sectons(atof(optarg));
+				if (report <= 0) {
+					fprintf(stderr, "Invalid report interval\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
 			case '?':
 			case 'h':
 			default:
@@ -526,6 +1071,22 @@ main(int argc, char **argv)
 		argv += optind;
 	}
 
+	/* kernel timestamps arrive apart from the reply, with nowhere to keep them */
+	if (echoed && ktimes) {
+		fprintf(stderr, "-e and -k are mutually exclusive\n");
+		return EXIT_FAILURE;
+	}
+
+	if (echoed && payload > STREAM_MAXLEN - PING2_LEN - ECHO_LEN) {
+		fprintf(stderr, "Invalid payload size; at most %d bytes with -e\n",
+			STREAM_MAXLEN - PING2_LEN - ECHO_LEN);
+		return EXIT_FAILURE;
+	}
+
+	if (-1 == schedparse(&sched, schedspec, interval)) {
+		return EXIT_FAILURE;
+	}
+
 	if (2 != argc) {
 		usage();
 		return EXIT_FAILURE;
@@ -541,6 +1102,44 @@ main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (ktimes && -1 == tsenable(s, 1)) {
+		perror("SO_TIMESTAMPING");
+		return EXIT_FAILURE;
+	}
+
+	if (busy && -1 == busysock(s)) {
+		perror("fcntl");
+		return EXIT_FAILURE;
+	}
+
+	if (-1 == rtthread(cpu, prio)) {
+		return EXIT_FAILURE;
+	}
+
+	/* replies from another client, or an earlier run, are told apart by this */
+	session = (uint32_t) clockreal() ^ (uint32_t) getpid() << 16;
+
+	/* not secret, but enough that a reply must have come from one of our pings */
+	key = (uint64_t) clockreal() ^ (uint64_t) clocknow() << 32 ^ (uint64_t) getpid() << 48;
+
+	if (proto2) {
+		msglen = PING2_LEN + ECHO_LEN * echoed + payload;
+
+		msg = malloc(msglen);
+		if (msg == NULL) {
+			perror("malloc");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (capfile != NULL) {
+		capf = capopen(capfile, interval);
+		if (capf == NULL) {
+			perror(capfile);
+			return EXIT_FAILURE;
+		}
+	}
+
 	if (0 != setvbuf(stdout, NULL, _IOLBF, 0)) {
 		perror("setvbuf");
 		return EXIT_FAILURE;
@@ -578,8 +1177,9 @@ main(int argc, char **argv)
 	 */
 
 	{
-		struct timeval before, after;
-		struct timeval remaining;
+		int64_t now;
+		int64_t next;
+		int64_t wait;
 		uint16_t seq;
 
 		enum {
@@ -590,49 +1190,63 @@ main(int argc, char **argv)
 		int culling;	/* "not sending" */
 		int recvfailed;	/* "not receiving" */
 
-		p = NULL;
+		if (echoed) {
+			if (-1 == seeninit(&seen, timeout)) {
+				perror("seeninit");
+				return EXIT_FAILURE;
+			}
+		} else if (-1 == pendinit(&pt)) {
+			perror("pendinit");
+			return EXIT_FAILURE;
+		}
+
 		culling = 0;
 		recvfailed = 0;
-		state = STATE_SEND;
+		state = STATE_SELECT;
 		seq = 0;
 		status = EXIT_SUCCESS;	/* TODO: calculate from culling/recvfailed flags */
 
-		before = mstotv(interval);
+		/* pings are sent to a schedule of absolute deadlines; see dgping */
+		stat_start = clocknow();
+		next = schedfirst(&sched, stat_start);
 
-		while (!culling || p != NULL) {
-			fd_set rfds;
+		win.start = stat_start;
+		win.end = stat_start + report;
 
-			culltimeouts(&p);
+		while (!culling || (echoed ? seen.out : pt.n) > 0) {
+			int expiring;
 
 			switch (state) {
 			case STATE_SELECT:
-				FD_ZERO(&rfds);
+				now = clocknow();
 
-				if (!recvfailed) {
-					FD_SET(s, &rfds);
+				culltimeouts(&pt, now);
+
+				if (culling && (echoed ? seen.out : pt.n) == 0) {
+					continue;
 				}
 
-				if (-1 == gettimeofday(&after, NULL)) {
-					perror("gettimeofday");
-					exit(EXIT_FAILURE);
+				if (!culling && report != 0 && now >= win.end) {
+					printreport(stdout, now);
 				}
 
-				/* calculate remaining interval */
-				{
-					struct timeval elapsed;
+				if (!culling && now >= next) {
+					state = STATE_SEND;
+					continue;
+				}
 
-					elapsed = xtimersub(&after, &before);
-					remaining = mstotv(interval);
-					remaining = xtimersub(&remaining, &elapsed);
-					xitimerfix(&remaining);
+				/* wake for whichever is sooner; the next ping, or the next timeout */
+				expiring = nextexpiry(&pt, now, &wait)
+					&& (culling || wait < next - now);
+				if (!expiring) {
+					wait = next - now;
 				}
 
-				if (-1 == gettimeofday(&before, NULL)) {
-					perror("gettimeofday");
-					exit(EXIT_FAILURE);
+				if (!culling && report != 0 && wait > win.end - now) {
+					wait = win.end - now;
 				}
 
-				switch (select(s + 1, &rfds, NULL, NULL, &remaining)) {
+				switch (waitrecv(recvfailed ? -1 : s, wait)) {
 				case -1:
 					if (errno == EINTR) {
 						break;
@@ -642,13 +1256,11 @@ main(int argc, char **argv)
 					exit(EXIT_FAILURE);
 				
 				case 0:
-					/* timeout */
-					state = culling ? STATE_SELECT : STATE_SEND;
+					/* timeout; the next ping, or the next to expire */
+					state = STATE_SELECT;
 					continue;
 
 				case 1:
-					assert(FD_ISSET(s, &rfds));
-
 					/* TODO: buffer partial sends, and re-enter STATE_SEND */
 					state = STATE_RECV;
 					continue;
@@ -657,7 +1269,7 @@ main(int argc, char **argv)
 				break;
 
 			case STATE_RECV:
-				switch (recvecho(s, &p, &sin)) {
+				switch (recvecho(s, &pt, &sin)) {
 				case -1:
 					if (errno == EINTR) {
 						break;
@@ -682,7 +1294,7 @@ main(int argc, char **argv)
 				break;
 
 			case STATE_SEND:
-				switch (sendecho(s, &p, seq)) {
+				switch (sendecho(s, &pt, seq, next)) {
 				case -1:
 					if (errno == EINTR) {
 						break;
@@ -700,10 +1312,11 @@ main(int argc, char **argv)
 						continue;
 					}
 
-					/* reset interval, for the next ping */
-					{
-						remaining = mstotv(interval);
-						xitimerfix(&remaining);
+					/* a ping sent late does not put back the next one */
+					next = schednext(&sched, next);
+					if (next == -1) {
+						state = STATE_CULL;
+						continue;
 					}
 
 					state = STATE_SELECT;
@@ -720,12 +1333,12 @@ main(int argc, char **argv)
 					return EXIT_FAILURE;
 				}
 
-				if (timeout <= DBL_EPSILON || cullfactor <= DBL_EPSILON) {
+				if (timeout <= 0 || cullfactor <= DBL_EPSILON) {
 					shouldexit = 1;
 					break;
 				}
 
-				if (-1 == (int) alarm(timeout / 1000.0 * cullfactor)) {
+				if (-1 == (int) alarm(timeout / (double) NS_PER_SEC * cullfactor)) {
 					perror("alarm");
 					return EXIT_FAILURE;
 				}
@@ -757,6 +1370,18 @@ main(int argc, char **argv)
 	}
 
 	close(s);
+	if (echoed) {
+		seenfini(&seen);
+	} else {
+		pendfini(&pt);
+	}
+	schedfini(&sched);
+	free(msg);
+
+	if (capf != NULL && -1 == capclose(capf)) {
+		perror(capfile);
+		return EXIT_FAILURE;
+	}
 
 	fprintf(stdout, "\n- STREAM Ping Statistics -\n");
 	printstats(stdout, 1);
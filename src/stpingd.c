@@ -6,8 +6,37 @@
 
 #define _XOPEN_SOURCE 600
 
+/* for SO_REUSEPORT */
+#if defined(__APPLE__)
+# define _DARWIN_C_SOURCE
+#else
+# define _DEFAULT_SOURCE
+#endif
+
+/*
+ * epoll(7) is used where available; select() remains as a portable fallback,
+ * and may be forced by building with -DNO_EPOLL.
+ */
+#if defined(__linux__) && !defined(__EMSCRIPTEN__) && !defined(NO_EPOLL)
+# define HAVE_EPOLL
+#endif
+
+/*
+ * SO_REUSEPORT_LB is FreeBSD's load-balancing variant; elsewhere
+ * SO_REUSEPORT distributes connections between sockets (on Linux, at least).
+ */
 #include <sys/socket.h>
+#if defined(SO_REUSEPORT_LB)
+# define HAVE_REUSEPORT SO_REUSEPORT_LB
+#elif defined(SO_REUSEPORT)
+# define HAVE_REUSEPORT SO_REUSEPORT
+#endif
+
 #include <sys/select.h>
+#include <sys/uio.h>
+#ifdef HAVE_EPOLL
+# include <sys/epoll.h>
+#endif
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -15,11 +44,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "common.h"
+#include "tstamp.h"
+#include "busy.h"
+#include "uring.h"
 
 /*
  * Workaround for inline assembly in glibc confusing MSan
@@ -34,23 +70,154 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 /*
- * A linked-list of inbound ping requests.
+ * Readiness notification for the listening socket and all our clients.
+ * Only sockets which are ready are visited on each wakeup.
+ */
+struct loop {
+#ifdef HAVE_EPOLL
+	int epfd;
+	struct epoll_event ev[64];
+	int n;
+#else
+	fd_set rmaster, wmaster;
+	fd_set rcurr, wcurr;
+	int maxfd;
+#endif
+	int i;
+};
+
+/* readiness for loopmod() and loopnext() */
+enum {
+	EV_READ  = 1 << 0,
+	EV_WRITE = 1 << 1
+};
+
+/*
+ * The size of each connection's input buffer, in bytes, allocated on its
+ * first read. Everything available which fits is read at once, however
+ * many messages that is. Longer messages are held in a buffer allocated
+ * to fit; see common.h.
+ */
+#define INBUF_SIZE 512
+
+/*
+ * The size of each connection's output queue, in bytes, allocated on its
+ * first reply, and the size to which it may grow for long replies. Replies
+ * which do not fit (because the peer is not reading) are dropped. A grown
+ * queue is freed once it drains, and the next reply allocates afresh.
+ */
+#define OUTQ_SIZE 1024
+#define OUTQ_MAX  (2 * STREAM_MAXLEN)
+
+/*
+ * An inbound connection, its partially-received ping request,
+ * and the replies not yet written to it. Both buffers are allocated,
+ * so that connections pack densely in their slab.
  */
 struct connection {
-	struct sockaddr_storage ss;
 	int socket;
+	int events;              /* of interest to the event loop */
+	struct rxbuf rx;
+
+	size_t outhead;          /* ring of outsize bytes */
+	size_t outlen;
+	size_t outsize;          /* 0 until the first reply */
+	char *out;
+
+	struct peer *peer;
+	struct connection *next; /* free list */
+
+#ifdef HAVE_URING
+	struct iovec iov[2];     /* the send in flight, if any */
+	int inflight;
+	int rxarmed;             /* a multishot receive is outstanding */
+	int eof;                 /* close once the send in flight completes */
+	char *outold;            /* replaced while in flight, and freed after */
+#endif
+};
 
+/*
+ * The peer's address, used only for diagnostics. This is kept apart from
+ * struct connection so that the fields touched per message stay dense.
+ */
+struct peer {
+	struct sockaddr_in sin;
 	char addr[sizeof "255.255.255.255:65535"];
+};
 
-	char buf[3 + 5 + 24 + 2];
-	size_t len;
+/*
+ * Connections are carved from slabs which are never freed; released
+ * connections are kept on a free list for reuse, so reconnect storms
+ * do not churn the allocator.
+ */
+#define SLAB_SIZE 256
+
+struct slab {
+	struct connection con[SLAB_SIZE];
+	struct peer peer[SLAB_SIZE];
+	struct slab *next;
+};
+
+/*
+ * Connections indexed by their socket. Descriptors are allocated lowest-first,
+ * so this stays dense, and lookup and removal are constant-time regardless of
+ * how many clients are connected.
+ */
+struct contab {
+	struct connection **a;
+	size_t n;
+
+	struct slab *slabs;
+	struct connection *free;
+};
 
-	struct connection *next;
+/*
+ * Each worker owns its listening socket, event loop and connections,
+ * so that one slow peer stalls only the peers sharing its worker.
+ * With more than one worker, the listening sockets share a port by way
+ * of SO_REUSEPORT, and the kernel distributes connections between them.
+ *
+ * The count of messages answered, and of syscalls made on the way (waits,
+ * reads, writes, and io_uring_enter), are written by the worker only, and
+ * read by the main thread at exit. Accepts and the like are per connection,
+ * and are not counted.
+ */
+struct worker {
+	pthread_t tid;
+	int s;
+	int cpu; /* -1 for unpinned */
+	struct sockaddr_in sin;
+	struct contab tab;
+	unsigned long count;
+	unsigned long calls;
 };
 
+/* far more threads than any machine has CPUs to run them on */
+#define MAX_WORKERS 1024
+
+static int busy;
+static int prio;
+
+/*
+ * Set by the main thread on SIGINT or SIGTERM, before it shuts down each
+ * listening socket to wake the worker waiting on it.
+ */
+static int stopping;
+
+static int
+stopped(void)
+{
+	return __atomic_load_n(&stopping, __ATOMIC_RELAXED);
+}
+
+static void
+tally(unsigned long *count, unsigned long n)
+{
+	__atomic_store_n(count, *count + n, __ATOMIC_RELAXED);
+}
 
 static int
-bindon(int s, struct sockaddr_in *sin)
+bindon(int s, struct sockaddr_in *sin, int reuseport)
 {
 	const int ov = 1;
 
@@ -60,13 +227,27 @@ bindon(int s, struct sockaddr_in *sin)
 		return -1;
 	}
 
+	if (reuseport) {
+#ifdef HAVE_REUSEPORT
+		if (-1 == setsockopt(s, SOL_SOCKET, HAVE_REUSEPORT, &ov, sizeof ov)) {
+			perror("setsockopt");
+			close(s);
+			return -1;
+		}
+#else
+		fprintf(stderr, "SO_REUSEPORT is not supported\n");
+		close(s);
+		return -1;
+#endif
+	}
+
 	if (-1 == bind(s, (void *) sin, sizeof *sin)) {
 		perror("bind");
 		close(s);
 		return -1;
 	}
 
-	if (-1 == listen(s, 1)) {
+	if (-1 == listen(s, SOMAXCONN)) {
 		perror("listen");
 		close(s);
 		return -1;
@@ -75,291 +256,1450 @@ bindon(int s, struct sockaddr_in *sin)
 	return s;
 }
 
-static struct connection *
-newcon(struct connection **head, int s, struct sockaddr *sa, socklen_t sz)
+static int
+loopinit(struct loop *l)
 {
-	struct connection *new;
-
-	assert(head != NULL);
-	assert(s != -1);
-	assert(sa != NULL);
-	assert(sz > 0);
+	assert(l != NULL);
 
-	new = malloc(sizeof *new);
-	if (new == NULL) {
-		perror("malloc");
-		return NULL;
+#ifdef HAVE_EPOLL
+	l->epfd = epoll_create(64);
+	if (l->epfd == -1) {
+		perror("epoll_create");
+		return -1;
 	}
 
-	{
-		const struct sockaddr_in *sin;
-		char addr[sizeof "255.255.255.255"];
-		unsigned port;
+	l->n = 0;
+#else
+	FD_ZERO(&l->rmaster);
+	FD_ZERO(&l->wmaster);
+	FD_ZERO(&l->rcurr);
+	FD_ZERO(&l->wcurr);
+	l->maxfd = -1;
+#endif
 
-		sin = (const void *) sa;
+	l->i = 0;
 
-		if (NULL == inet_ntop(sa->sa_family, &sin->sin_addr, addr, sizeof addr)) {
-			perror("inet_ntop");
-		}
+	return 0;
+}
 
-		port = (unsigned) ntohs(sin->sin_port);
+static void
+loopfini(struct loop *l)
+{
+	assert(l != NULL);
 
-		snprintf(new->addr, sizeof new->addr, "%s:%u", addr, port);
-	}
+#ifdef HAVE_EPOLL
+	close(l->epfd);
+#else
+	(void) l;
+#endif
+}
 
-	new->socket = s;
-	new->len = sizeof new->buf - 1;
+static int
+loopadd(struct loop *l, int fd)
+{
+	assert(l != NULL);
+	assert(fd != -1);
 
-	memcpy(&new->ss, sa, sz);
+#ifdef HAVE_EPOLL
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof ev);
+		ev.events  = EPOLLIN;
+		ev.data.fd = fd;
 
-	printf("connection from %s\n", new->addr);
+		if (-1 == epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+#else
+	if (fd >= FD_SETSIZE) {
+		return -1;
+	}
 
-	new->next = *head;
-	*head = new;
+	FD_SET(fd, &l->rmaster);
+	FD_CLR(fd, &l->rcurr); /* not ready until the next select() */
+	FD_CLR(fd, &l->wcurr);
+	l->maxfd = MAX(l->maxfd, fd);
+#endif
 
-	return new;
+	return 0;
 }
 
-static struct connection *
-findcon(struct connection **head, int s)
+/*
+ * Set the readiness of interest for a socket; EV_READ is always of interest.
+ */
+static int
+loopmod(struct loop *l, int fd, int events)
 {
-	struct connection **current;
+	assert(l != NULL);
+	assert(fd != -1);
 
-	assert(head != NULL);
-	assert(s != -1);
+#ifdef HAVE_EPOLL
+	{
+		struct epoll_event ev;
 
-	for (current = head; *current != NULL; current = &(*current)->next) {
-		if ((*current)->socket == s) {
-			return *current;
+		memset(&ev, 0, sizeof ev);
+		ev.events  = EPOLLIN | ((events & EV_WRITE) ? EPOLLOUT : 0);
+		ev.data.fd = fd;
+
+		if (-1 == epoll_ctl(l->epfd, EPOLL_CTL_MOD, fd, &ev)) {
+			perror("epoll_ctl");
+			return -1;
 		}
 	}
+#else
+	if (events & EV_WRITE) {
+		FD_SET(fd, &l->wmaster);
+	} else {
+		FD_CLR(fd, &l->wmaster);
+		FD_CLR(fd, &l->wcurr);
+	}
+#endif
 
-	return NULL;
+	return 0;
 }
 
 static void
-removecon(struct connection **head, int s)
+loopdel(struct loop *l, int fd)
 {
-	struct connection *tmp;
-	struct connection **current;
+	assert(l != NULL);
+	assert(fd != -1);
 
-	assert(head != NULL);
-	assert(s != -1);
+#ifdef HAVE_EPOLL
+	/* closing the descriptor would also do this */
+	if (-1 == epoll_ctl(l->epfd, EPOLL_CTL_DEL, fd, NULL)) {
+		perror("epoll_ctl");
+	}
+#else
+	FD_CLR(fd, &l->rmaster);
+	FD_CLR(fd, &l->wmaster);
+	FD_CLR(fd, &l->rcurr);
+	FD_CLR(fd, &l->wcurr);
+#endif
+}
+
+/*
+ * Wait for at least one socket to become ready. Ready sockets are then
+ * retrieved one at a time by loopnext(). If spin is set, this returns
+ * straight away, perhaps with none ready, for the caller to try again.
+ */
+static int
+loopwait(struct loop *l, int spin)
+{
+#ifndef HAVE_EPOLL
+	struct timeval zero = { 0, 0 };
+#endif
 
-	for (current = head; *current != NULL; current = &(*current)->next) {
-		if ((*current)->socket == s) {
-			tmp = *current;
+	assert(l != NULL);
 
-			printf("disconnection from %s\n", tmp->addr);
+	l->i = 0;
 
-			*current = (*current)->next;
-			free(tmp);
-			return;
+#ifdef HAVE_EPOLL
+	l->n = epoll_wait(l->epfd, l->ev, sizeof l->ev / sizeof *l->ev, spin ? 0 : -1);
+	if (l->n == -1) {
+		l->n = 0;
+		if (errno == EINTR) {
+			return 0;
 		}
+		perror("epoll_wait");
+		return -1;
+	}
+#else
+	l->rcurr = l->rmaster;
+	l->wcurr = l->wmaster;
+
+	if (-1 == select(l->maxfd + 1, &l->rcurr, &l->wcurr, NULL, spin ? &zero : NULL)) {
+		FD_ZERO(&l->rcurr);
+		FD_ZERO(&l->wcurr);
+		perror("select");
+		return -1;
 	}
+#endif
+
+	return 0;
 }
 
+/*
+ * Return the next ready socket from the most recent loopwait(),
+ * or -1 if none remain. Its readiness is stored to *events.
+ */
 static int
-recvecho(struct connection **head, int s, uint16_t *seq, struct sockaddr_in *sin)
+loopnext(struct loop *l, int *events)
 {
-	struct connection *conn;
-	ssize_t r;
+	assert(l != NULL);
+	assert(events != NULL);
 
-	(void) sin;
+#ifdef HAVE_EPOLL
+	if (l->i < l->n) {
+		const struct epoll_event *ev;
 
-	assert(head != NULL);
+		ev = &l->ev[l->i++];
 
-	conn = findcon(head, s);
+		/* errors and hangups are discovered by reading */
+		*events = 0;
+		if (ev->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			*events |= EV_READ;
+		}
+		if (ev->events & EPOLLOUT) {
+			*events |= EV_WRITE;
+		}
 
-	assert(conn != NULL);
+		return ev->data.fd;
+	}
+#else
+	while (l->i <= l->maxfd) {
+		int fd;
 
-	r = recv(s, conn->buf + (sizeof conn->buf - 1 - conn->len), conn->len, 0);
-	if (r == -1) {
-		switch (errno) {
-		case EINTR:
-			return 0;
+		fd = l->i++;
 
-		default:
-			perror("recv");
-			return -1;
+		*events = 0;
+		if (FD_ISSET(fd, &l->rcurr)) {
+			*events |= EV_READ;
+		}
+		if (FD_ISSET(fd, &l->wcurr)) {
+			*events |= EV_WRITE;
 		}
-	}
 
-	if (r == 0) {
-		return -1;
+		if (*events != 0) {
+			return fd;
+		}
 	}
+#endif
 
-	assert(r >= 1);
-	assert(r <= (ssize_t) conn->len);
-
-	conn->len -= r;
+	return -1;
+}
 
-	if (conn->len > 0) {
-		return 0;
-	}
+static int
+growslab(struct contab *tab)
+{
+	struct slab *new;
+	size_t i;
 
-	conn->len = sizeof conn->buf - 1;
+	assert(tab != NULL);
 
-	conn->buf[sizeof conn->buf - 1] = '\0';
+	new = malloc(sizeof *new);
+	if (new == NULL) {
+		perror("malloc");
+		return -1;
+	}
 
-	if (1 != validate(conn->buf, seq)) {
-		return 0;
+	for (i = SLAB_SIZE; i-- > 0; ) {
+		new->con[i].peer = &new->peer[i];
+		new->con[i].next = tab->free;
+		tab->free = &new->con[i];
 	}
 
-	printf("%u bytes from %s seq=%d\n",
-		(unsigned) strlen(conn->buf), conn->addr, (int) *seq);
+	new->next = tab->slabs;
+	tab->slabs = new;
 
-	return 1;
+	return 0;
 }
 
-static int
-sendecho(int s, uint16_t seq)
+static struct connection *
+newcon(struct contab *tab, int s, struct sockaddr *sa, socklen_t sz)
 {
-	const char *buf;
-	size_t len;
+	struct connection *new;
 
-	buf = mkping(seq);
-	len = strlen(buf);
+	assert(tab != NULL);
+	assert(s != -1);
+	assert(sa != NULL);
+	assert(sz > 0);
 
-	while (len > 0) {
-		ssize_t r;
+	if ((size_t) s >= tab->n) {
+		struct connection **tmp;
+		size_t n;
 
-		r = send(s, buf, len, 0);
-		if (r == -1) {
-			switch (errno) {
-			case ENOBUFS:
-			case EINTR:
-				continue;
+		n = tab->n == 0 ? 64 : tab->n;
+		while (n <= (size_t) s) {
+			n *= 2;
+		}
 
-			default:
-				perror("send");
-				return -1;
-			}
+		tmp = realloc(tab->a, n * sizeof *tab->a);
+		if (tmp == NULL) {
+			perror("realloc");
+			return NULL;
 		}
 
-		assert(r >= 0);
-		assert(r <= (ssize_t) len);
+		memset(tmp + tab->n, 0, (n - tab->n) * sizeof *tmp);
 
-		len -= r;
-		buf += r;
+		tab->a = tmp;
+		tab->n = n;
 	}
 
-	return 0;
-}
+	assert(tab->a[s] == NULL);
 
-int
-main(int argc, char *argv[])
-{
-	int s;
-	struct sockaddr_in sin;
-	struct connection *head;
+	if (tab->free == NULL && -1 == growslab(tab)) {
+		return NULL;
+	}
 
-	head = NULL;
+	new = tab->free;
+	tab->free = new->next;
 
-	if (3 != argc) {
-		fprintf(stderr, "usage: stpingd <address> <port>\n");
-		return EXIT_FAILURE;
-	}
+	{
+		struct peer *peer;
+		char addr[sizeof "255.255.255.255"];
+		unsigned port;
 
-	s = getaddr(argv[1], argv[2], &sin, SOCK_STREAM, IPPROTO_TCP);
-	if (-1 == s) {
-		return EXIT_FAILURE;
-	}
+		peer = new->peer;
 
-	/* TODO bind on INADDR_ANY instead? We could broadcast pings by default. */
-	s = bindon(s, &sin);
-	if (-1 == s) {
-		fprintf(stderr, "unable to listen\n");
-		return EXIT_FAILURE;
-	}
+		memset(&peer->sin, 0, sizeof peer->sin);
+		memcpy(&peer->sin, sa, sz < sizeof peer->sin ? sz : sizeof peer->sin);
 
-	if (0 != setvbuf(stdout, NULL, _IOLBF, 0)) {
-		perror("setvbuf");
-		return EXIT_FAILURE;
+		if (NULL == inet_ntop(AF_INET, &peer->sin.sin_addr, addr, sizeof addr)) {
+			perror("inet_ntop");
+		}
+
+		port = (unsigned) ntohs(peer->sin.sin_port);
+
+		snprintf(peer->addr, sizeof peer->addr, "%s:%u", addr, port);
 	}
 
-	/* TODO find "TCP" automatically */
-	printf("listening on %s:%s %s\n", argv[1], argv[2], "TCP/IP");
+	new->socket = s;
+	rxinit(&new->rx, NULL, INBUF_SIZE);
+	new->events = EV_READ;
+	new->outhead = 0;
+	new->outlen = 0;
+	new->outsize = 0;
+	new->out = NULL;
+	new->next = NULL;
+#ifdef HAVE_URING
+	new->inflight = 0;
+	new->rxarmed = 0;
+	new->eof = 0;
+	new->outold = NULL;
+#endif
 
-	{
-		fd_set master;
-		int maxfd;
+	printf("connection from %s\n", new->peer->addr);
 
-		FD_ZERO(&master);
-		FD_SET(s, &master);	
+	tab->a[s] = new;
 
-		maxfd = s;
+	return new;
+}
 
-		for (;;) {
-			fd_set curr;
-			int i;
+static struct connection *
+findcon(const struct contab *tab, int s)
+{
+	assert(tab != NULL);
+	assert(s != -1);
 
-			curr = master;
+	if ((size_t) s >= tab->n) {
+		return NULL;
+	}
 
-			/* select on our server socket and all our clients */
-			if (-1 == select(maxfd + 1, &curr, NULL, NULL, NULL)) {
-				perror("select");
-				return EXIT_FAILURE;
-			} 
+	return tab->a[s];
+}
 
-			if (FD_ISSET(s, &curr)) {
-				struct sockaddr_storage ss;
-				struct connection *new;
-				socklen_t size;
-				int peer; 
+static void
+removecon(struct contab *tab, int s)
+{
+	struct connection *tmp;
 
-				size = sizeof ss;
+	assert(tab != NULL);
+	assert(s != -1);
 
-				peer = accept(s, (struct sockaddr *) &ss, &size);
-				if (peer < 0) {
-					perror("accept"); 
-					return EXIT_FAILURE;
-				}
+	tmp = findcon(tab, s);
+	if (tmp == NULL) {
+		return;
+	}
 
-				assert(size <= sizeof ss);
+	printf("disconnection from %s\n", tmp->peer->addr);
 
-				if (peer > FD_SETSIZE) {
-					printf("too many peers; rejecting new connection from %d\n", peer);
-					close(peer);
-				}
+	tab->a[s] = NULL;
 
-				new = newcon(&head, peer, (struct sockaddr *) &ss, size);
-				if (new == NULL) {
-					return EXIT_FAILURE;
-				}
+	rxfini(&tmp->rx);
 
-				FD_SET(peer, &master); 
-				FD_CLR(peer, &curr); /* just to ensure the bit is present */
-				maxfd = MAX(maxfd, peer);
-			}
+	free(tmp->out);
+	tmp->out = NULL;
 
-			for (i = 0; i <= maxfd; ++i) {
-				uint16_t seq;
-				int r;
+#ifdef HAVE_URING
+	free(tmp->outold);
+#endif
 
-				if (i == s || !FD_ISSET(i, &curr)) {
-					continue;
-				}
+	tmp->socket = -1;
+	tmp->next = tab->free;
+	tab->free = tmp;
+}
 
-				r = recvecho(&head, i, &seq, &sin);
-				if (r == -1) {
-					FD_CLR(i, &master);
-					removecon(&head, i);					
-					close(i);
-					continue;
-				}
+/*
+ * Close every connection and the listening socket, and free the table,
+ * on the way out.
+ */
+static void
+closeall(struct worker *w)
+{
+	size_t i;
 
-				if (r == 0) {
-					continue;
-				}
+	assert(w != NULL);
 
-				sendecho(i, seq);
-			}
+	for (i = 0; i < w->tab.n; i++) {
+		if (w->tab.a[i] != NULL) {
+			removecon(&w->tab, i);
+			close(i);
 		}
 	}
 
-	/* NOTREACHED */
+	close(w->s);
 
-	return EXIT_SUCCESS;
-}
+	while (w->tab.slabs != NULL) {
+		struct slab *next;
 
+		next = w->tab.slabs->next;
+		free(w->tab.slabs);
+		w->tab.slabs = next;
+	}
+
+	free(w->tab.a);
+}
+
+static int
+recvecho(struct connection *conn)
+{
+	ssize_t r;
+
+	assert(conn != NULL);
+
+	r = rxfill(conn->socket, &conn->rx, 0);
+	if (r == -1) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			return 0;
+
+		default:
+			perror("recv");
+			return -1;
+		}
+	}
+
+	if (r == 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The queued output, as at most two spans of the ring.
+ */
+static int
+outvec(struct connection *conn, struct iovec iov[2])
+{
+	size_t n;
+
+	assert(conn != NULL);
+	assert(conn->outlen > 0);
+
+	n = conn->outsize - conn->outhead;
+	if (n >= conn->outlen) {
+		n = conn->outlen;
+	}
+
+	iov[0].iov_base = conn->out + conn->outhead;
+	iov[0].iov_len  = n;
+
+	if (n == conn->outlen) {
+		return 1;
+	}
+
+	iov[1].iov_base = conn->out;
+	iov[1].iov_len  = conn->outlen - n;
+
+	return 2;
+}
+
+static void
+dequeue(struct connection *conn, size_t n)
+{
+	assert(conn != NULL);
+	assert(n <= conn->outlen);
+
+	conn->outhead = (conn->outhead + n) % conn->outsize;
+	conn->outlen -= n;
+
+	if (conn->outlen > 0) {
+		return;
+	}
+
+	conn->outhead = 0;
+
+	/* a grown ring is given back once drained, so that it is held only while in use */
+	if (conn->outsize > OUTQ_SIZE) {
+#ifdef HAVE_URING
+		assert(!conn->inflight);
+#endif
+		free(conn->out);
+		conn->out     = NULL;
+		conn->outsize = 0;
+	}
+}
+
+/*
+ * Move the output queue to a larger ring, with its contents from the start.
+ * Returns -1 on error.
+ */
+static int
+growout(struct connection *conn, size_t size)
+{
+	struct iovec iov[2];
+	char *new, *old;
+	int i, n;
+
+	assert(conn != NULL);
+	assert(size > conn->outsize);
+
+	new = malloc(size);
+	if (new == NULL) {
+		return -1;
+	}
+
+	n = conn->outlen > 0 ? outvec(conn, iov) : 0;
+	conn->outlen = 0;
+	for (i = 0; i < n; i++) {
+		memcpy(new + conn->outlen, iov[i].iov_base, iov[i].iov_len);
+		conn->outlen += iov[i].iov_len;
+	}
+
+	/* a write in flight still reads from the ring it was given, which is kept until it completes */
+	old = conn->out;
+#ifdef HAVE_URING
+	if (conn->inflight && conn->outold == NULL) {
+		conn->outold = old;
+		old = NULL;
+	}
+#endif
+	free(old);
+
+	conn->out     = new;
+	conn->outsize = size;
+	conn->outhead = 0;
+
+	return 0;
+}
+
+/*
+ * Queue a reply for writing. Returns -1 if there is no room.
+ */
+static int
+enqueue(struct connection *conn, const char *buf, size_t len)
+{
+	size_t tail, n;
+
+	assert(conn != NULL);
+	assert(buf != NULL);
+
+	if (len > conn->outsize - conn->outlen) {
+		size_t size;
+
+		if (len > OUTQ_MAX - conn->outlen) {
+			return -1;
+		}
+
+		size = conn->outsize > 0 ? conn->outsize : OUTQ_SIZE;
+		while (size < conn->outlen + len) {
+			size *= 2;
+		}
+
+		if (-1 == growout(conn, size < OUTQ_MAX ? size : OUTQ_MAX)) {
+			perror("malloc");
+			return -1;
+		}
+	}
+
+	tail = (conn->outhead + conn->outlen) % conn->outsize;
+
+	n = conn->outsize - tail < len ? conn->outsize - tail : len;
+	memcpy(conn->out + tail, buf, n);
+	memcpy(conn->out, buf + n, len - n);
+
+	conn->outlen += len;
+
+	return 0;
+}
+
+static int
+sendecho(struct connection *conn, const char *buf, size_t len, uint64_t seq)
+{
+	assert(conn != NULL);
+	assert(buf != NULL);
+
+	if (-1 == enqueue(conn, buf, len)) {
+		printf("output queue full for %s; dropping reply seq=%llu\n",
+			conn->peer->addr, (unsigned long long) seq);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reply to every complete message received so far.
+ * Returns the number of messages answered.
+ */
+static unsigned long
+replyall(struct connection *conn)
+{
+	unsigned long n;
+	char *p;
+	size_t len;
+
+	assert(conn != NULL);
+
+	n = 0;
+
+	/* every message from one recv() shares its timestamp */
+	while (p = rxframe(&conn->rx, &len), p != NULL) {
+		char buf[PING_LEN + 1];
+		const char *reply;
+		uint16_t seq;
+
+		/* version 2 replies are made in place, however long */
+		if (isping2(p, len)) {
+			struct ping2 p2;
+
+			if (1 != getping2(p, len, &p2)) {
+				continue;
+			}
+
+			printf("%u bytes from %s seq=%llu\n",
+				(unsigned) len, conn->peer->addr, (unsigned long long) p2.seq);
+
+			reply2(p, len, conn->rx.kts, &p2);
+
+			(void) sendecho(conn, p, len, p2.seq);
+			n++;
+			continue;
+		}
+
+		assert(len == PING_LEN);
+
+		memcpy(buf, p, len);
+		buf[len] = '\0';
+
+		if (1 != validate(buf, &seq)) {
+			continue;
+		}
+
+		printf("%u bytes from %s seq=%d\n",
+			(unsigned) len, conn->peer->addr, (int) seq);
+
+		reply = mkreply(seq, stamprx(buf, conn->rx.kts));
+
+		(void) sendecho(conn, reply, strlen(reply), seq);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Write as much queued output as the socket will take, coalescing all
+ * queued replies into each writev(). Each writev() is counted to *calls.
+ * Returns -1 on error, 1 if output remains queued, or 0 if the queue is empty.
+ */
+static int
+flush(struct connection *conn, unsigned long *calls)
+{
+	assert(conn != NULL);
+	assert(calls != NULL);
+
+	while (conn->outlen > 0) {
+		struct iovec iov[2];
+		ssize_t r;
+
+		tally(calls, 1);
+
+		r = writev(conn->socket, iov, outvec(conn, iov));
+		if (r == -1) {
+			switch (errno) {
+			case EINTR:
+				continue;
+
+			case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK:
+#endif
+			case ENOBUFS:
+				return 1;
+
+			default:
+				perror("writev");
+				return -1;
+			}
+		}
+
+		dequeue(conn, r);
+	}
+
+	return 0;
+}
+
+static int
+nonblock(int s)
+{
+	int flags;
+
+	flags = fcntl(s, F_GETFL, 0);
+	if (flags == -1) {
+		perror("fcntl");
+		return -1;
+	}
+
+	if (-1 == fcntl(s, F_SETFL, flags | O_NONBLOCK)) {
+		perror("fcntl");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 0 for accept(2) errors which leave the listening socket usable,
+ * having logged them. Running out of descriptors is waited out briefly,
+ * since the listening socket stays readable until one is freed.
+ */
+static int
+acceptfail(int e)
+{
+	static const struct timespec backoff = { 0, 10 * 1000 * 1000 };
+
+	errno = e;
+	perror("accept");
+
+	switch (e) {
+	case EMFILE:
+	case ENFILE:
+		nanosleep(&backoff, NULL);
+		return 0;
+
+	case ECONNABORTED:
+	case EINTR:
+	case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+static int
+serve(struct worker *w)
+{
+	struct loop l;
+
+	assert(w != NULL);
+	assert(w->s != -1);
+
+	if (-1 == loopinit(&l)) {
+		return -1;
+	}
+
+	if (-1 == loopadd(&l, w->s)) {
+		return -1;
+	}
+
+	while (!stopped()) {
+		int events;
+		int i;
+
+		/* wait on our server socket and all our clients */
+		tally(&w->calls, 1);
+		if (-1 == loopwait(&l, busy)) {
+			return -1;
+		}
+
+		while (i = loopnext(&l, &events), i != -1) {
+			struct connection *conn;
+			int r;
+
+			if (i == w->s) {
+				struct sockaddr_storage ss;
+				struct connection *new;
+				socklen_t size;
+				int peer;
+
+				size = sizeof ss;
+
+				peer = accept(w->s, (struct sockaddr *) &ss, &size);
+				if (peer < 0) {
+					/* the main thread shut the listening socket down */
+					if (stopped()) {
+						continue;
+					}
+
+					if (-1 == acceptfail(errno)) {
+						return -1;
+					}
+
+					continue;
+				}
+
+				assert(size <= sizeof ss);
+
+				/* so that no one peer can stall the others */
+				if (-1 == nonblock(peer)) {
+					close(peer);
+					continue;
+				}
+
+				if (busy && -1 == busysock(peer)) {
+					perror("fcntl");
+					close(peer);
+					continue;
+				}
+
+				if (-1 == loopadd(&l, peer)) {
+					printf("too many peers; rejecting new connection from %d\n", peer);
+					close(peer);
+					continue;
+				}
+
+				new = newcon(&w->tab, peer, (struct sockaddr *) &ss, size);
+				if (new == NULL) {
+					return -1;
+				}
+
+				continue;
+			}
+
+			conn = findcon(&w->tab, i);
+			assert(conn != NULL);
+
+			if (events & EV_READ) {
+				tally(&w->calls, 1);
+				if (-1 == recvecho(conn)) {
+					goto drop;
+				}
+
+				tally(&w->count, replyall(conn));
+			}
+
+			if (conn->outlen == 0) {
+				continue;
+			}
+
+			/* written straight away where possible, else when writable */
+			r = flush(conn, &w->calls);
+			if (r == -1) {
+				goto drop;
+			}
+
+			if ((r == 1) != ((conn->events & EV_WRITE) != 0)) {
+				conn->events = EV_READ | (r == 1 ? EV_WRITE : 0);
+				if (-1 == loopmod(&l, i, conn->events)) {
+					goto drop;
+				}
+			}
+
+			continue;
+
+		drop:
+
+			loopdel(&l, i);
+			removecon(&w->tab, i);
+			close(i);
+		}
+	}
+
+	loopfini(&l);
+
+	return 0;
+}
+
+#ifdef HAVE_URING
+
+#define URING_BUFS  256
+#define URING_BUFSZ 4096
+
+/* the low bits of user_data say what completed */
+enum {
+	OP_ACCEPT = 0,
+	OP_RECV   = 1,
+	OP_SEND   = 2,
+	OP_MASK   = 3
+};
+
+/*
+ * Connections with a receive or a send which there was no room to submit,
+ * until completions are reaped; see uring_sqe(). A connection may appear
+ * more than once, or be gone by the time it is retried.
+ */
+struct stalled {
+	int *s;
+	size_t n;
+	size_t size;
+};
+
+static void
+stall(struct stalled *st, int s)
+{
+	if (st->n == st->size) {
+		size_t size;
+		int *tmp;
+
+		size = st->size == 0 ? 64 : st->size * 2;
+
+		tmp = realloc(st->s, size * sizeof *st->s);
+		if (tmp == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		st->s = tmp;
+		st->size = size;
+	}
+
+	st->s[st->n++] = s;
+}
+
+/*
+ * Returns NULL if there is no room to submit this yet.
+ */
+static struct io_uring_sqe *
+getsqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(u);
+	if (sqe == NULL && errno != EBUSY) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+
+	return sqe;
+}
+
+/*
+ * Each of these returns 0 if there was no room to submit, in which case
+ * it is to be tried again later.
+ */
+static int
+armaccept(struct uring *u, int s)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = getsqe(u);
+	if (sqe == NULL) {
+		return 0;
+	}
+
+	sqe->opcode    = IORING_OP_ACCEPT;
+	sqe->fd        = s;
+	sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = OP_ACCEPT;
+
+	return 1;
+}
+
+static int
+armrecv(struct uring *u, struct connection *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	assert(!conn->rxarmed);
+
+	sqe = getsqe(u);
+	if (sqe == NULL) {
+		return 0;
+	}
+
+	sqe->opcode    = IORING_OP_RECV;
+	sqe->fd        = conn->socket;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->user_data = ((uint64_t) conn->socket << 2) | OP_RECV;
+
+	conn->rxarmed = 1;
+
+	return 1;
+}
+
+/*
+ * Write everything queued for a connection. Only one write is in flight
+ * per connection, so that replies stay in order; replies queued meanwhile
+ * are coalesced into the next.
+ */
+static int
+armsend(struct uring *u, struct connection *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	assert(!conn->inflight);
+	assert(conn->outlen > 0);
+
+	sqe = getsqe(u);
+	if (sqe == NULL) {
+		return 0;
+	}
+
+	sqe->opcode    = IORING_OP_WRITEV;
+	sqe->fd        = conn->socket;
+	sqe->addr      = (uintptr_t) conn->iov;
+	sqe->len       = outvec(conn, conn->iov);
+	sqe->user_data = ((uint64_t) conn->socket << 2) | OP_SEND;
+
+	conn->inflight = 1;
+
+	return 1;
+}
+
+/*
+ * Arm whatever a connection is missing: its receive, unless it has ended,
+ * and a send for anything queued, unless one is in flight.
+ */
+static void
+rearm(struct uring *u, struct stalled *st, struct connection *conn)
+{
+	if (!conn->rxarmed && !conn->eof && !armrecv(u, conn)) {
+		stall(st, conn->socket);
+		return;
+	}
+
+	if (conn->outlen > 0 && !conn->inflight && !armsend(u, conn)) {
+		stall(st, conn->socket);
+	}
+}
+
+static void
+closecon(struct contab *tab, struct connection *conn)
+{
+	int s;
+
+	s = conn->socket;
+	removecon(tab, s);
+	close(s);
+}
+
+/*
+ * io_uring(7) event loop. A multishot accept stays armed on the listening
+ * socket, and a multishot receive on each connection, delivering into
+ * kernel-selected buffers; replies are queued as sends without waiting on
+ * them. Many completions are reaped per io_uring_enter().
+ *
+ * Returns -1 if io_uring is unavailable, or 0 once stopped.
+ */
+static int
+serve_uring(struct worker *w)
+{
+	struct stalled st;
+	struct uring u;
+	int accepting;
+
+	assert(w != NULL);
+
+	if (-1 == uring_init(&u, 1024, URING_BUFS, URING_BUFSZ)) {
+		perror("io_uring");
+		return -1;
+	}
+
+	memset(&st, 0, sizeof st);
+
+	accepting = armaccept(&u, w->s);
+
+	while (!stopped()) {
+		struct io_uring_cqe *cqe;
+
+		if (!accepting) {
+			accepting = armaccept(&u, w->s);
+		}
+
+		/* those retried may stall again, and are kept after those still to retry */
+		if (st.n > 0) {
+			size_t i, n;
+
+			n = st.n;
+			for (i = 0; i < n; i++) {
+				struct connection *conn;
+
+				conn = findcon(&w->tab, st.s[i]);
+				if (conn != NULL) {
+					rearm(&u, &st, conn);
+				}
+			}
+
+			memmove(st.s, st.s + n, (st.n - n) * sizeof *st.s);
+			st.n -= n;
+		}
+
+		/* EBUSY: completions are backed up, and are reaped before trying again */
+		tally(&w->calls, 1);
+		if (-1 == uring_submit(&u, 1) && errno != EBUSY && errno != EAGAIN) {
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+
+		while (cqe = uring_cqe(&u), cqe != NULL) {
+			struct connection *conn;
+			int s;
+
+			switch (cqe->user_data & OP_MASK) {
+			case OP_ACCEPT:
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					accepting = armaccept(&u, w->s);
+				}
+
+				if (cqe->res < 0) {
+					if (stopped()) {
+						break;
+					}
+
+					if (-1 == acceptfail(-cqe->res)) {
+						exit(EXIT_FAILURE);
+					}
+
+					break;
+				}
+
+				{
+					struct sockaddr_in sin;
+					socklen_t size;
+
+					s = cqe->res;
+					size = sizeof sin;
+
+					memset(&sin, 0, sizeof sin);
+					if (-1 == getpeername(s, (struct sockaddr *) &sin, &size)) {
+						perror("getpeername");
+					}
+
+					conn = newcon(&w->tab, s, (struct sockaddr *) &sin, sizeof sin);
+					if (conn == NULL) {
+						exit(EXIT_FAILURE);
+					}
+				}
+
+				rearm(&u, &st, conn);
+				break;
+
+			case OP_RECV:
+				s = cqe->user_data >> 2;
+				conn = findcon(&w->tab, s);
+				assert(conn != NULL);
+
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					conn->rxarmed = 0;
+				}
+
+				if (cqe->res > 0) {
+					const char *p;
+					size_t n;
+
+					p = uring_buf(&u, cqe);
+					n = cqe->res;
+
+					/* a buffer may hold any number of messages, or part of one */
+					while (n > 0) {
+						size_t k;
+
+						/* none taken only if there is no buffer, for want of memory */
+						k = rxput(&conn->rx, p, n);
+						if (k == 0) {
+							break;
+						}
+
+						p += k;
+						n -= k;
+
+						tally(&w->count, replyall(conn));
+					}
+
+					uring_recycle(&u, cqe);
+
+					rearm(&u, &st, conn);
+					break;
+				}
+
+				uring_recycle(&u, cqe);
+
+				/* ENOBUFS: we ran out of provided buffers */
+				if (cqe->res == -ENOBUFS) {
+					rearm(&u, &st, conn);
+					break;
+				}
+
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					perror("recv");
+				}
+
+				if (!conn->inflight) {
+					closecon(&w->tab, conn);
+				} else {
+					conn->eof = 1;
+				}
+
+				break;
+
+			case OP_SEND:
+				s = cqe->user_data >> 2;
+				conn = findcon(&w->tab, s);
+				assert(conn != NULL);
+				assert(conn->inflight);
+
+				conn->inflight = 0;
+
+				free(conn->outold);
+				conn->outold = NULL;
+
+				if (conn->eof) {
+					closecon(&w->tab, conn);
+					break;
+				}
+
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					perror("writev");
+					dequeue(conn, conn->outlen);
+					break;
+				}
+
+				dequeue(conn, cqe->res);
+
+				/* the remainder of a short write, and anything since */
+				rearm(&u, &st, conn);
+
+				break;
+			}
+
+			uring_seen(&u);
+		}
+	}
+
+	uring_fini(&u);
+	free(st.s);
+
+	return 0;
+}
+
+#endif
+
+static int uring;
+
+static int
+run(struct worker *w)
+{
+	if (-1 == rtthread(w->cpu, prio)) {
+		return -1;
+	}
+
+	if (uring) {
+#ifdef HAVE_URING
+		if (0 == serve_uring(w)) {
+			return 0;
+		}
+#endif
+		fprintf(stderr, "io_uring unavailable; falling back to %s\n",
+#ifdef HAVE_EPOLL
+			"epoll");
+#else
+			"select");
+#endif
+	}
+
+	return serve(w);
+}
+
+static void *
+work(void *arg)
+{
+	if (-1 == run(arg)) {
+		exit(EXIT_FAILURE);
+	}
+
+	closeall(arg);
+
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: stpingd [ -u | -b ] [ -p ] [ -f <priority> ] [ -w <threads> ]\n"
+		"\t<address> <port>\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct worker *workers;
+	unsigned nworkers;
+	unsigned long count, calls;
+	unsigned i;
+	sigset_t set;
+	int sig;
+	int pin;
+
+	nworkers = 1;
+	pin = 0;
+
+	/* Handle CLI options */
+	{
+		int c;
+
+		while ((c = getopt(argc, argv, "bf:hpuw:")) != -1) {
+			switch (c) {
+			case 'b':
+				busy = 1;
+				break;
+
+			case 'f':
+				prio = atoi(optarg);
+				if (prio <= 0 || optarg[strspn(optarg, "0123456789")]) {
+					fprintf(stderr, "Invalid priority\n");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'p':
+				pin = 1;
+				break;
+
+			case 'u':
+				uring = 1;
+				break;
+
+			case 'w':
+				{
+					unsigned long l;
+					char *ep;
+
+					l = strtoul(optarg, &ep, 10);
+					if (ep == optarg || *ep || l == 0 || l > MAX_WORKERS) {
+						fprintf(stderr, "Invalid thread count; expected 1 to %d\n", MAX_WORKERS);
+						return EXIT_FAILURE;
+					}
+
+					nworkers = l;
+				}
+				break;
+
+			case '?':
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+		argc -= optind;
+		argv += optind;
+	}
+
+	if (2 != argc || (busy && uring)) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	workers = calloc(nworkers, sizeof *workers);
+	if (workers == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+
+		w->s = getaddr(argv[0], argv[1], &w->sin, SOCK_STREAM, IPPROTO_TCP);
+		if (-1 == w->s) {
+			return EXIT_FAILURE;
+		}
+
+		/* TODO bind on INADDR_ANY instead? We could broadcast pings by default. */
+		w->s = bindon(w->s, &w->sin, nworkers > 1);
+		if (-1 == w->s) {
+			fprintf(stderr, "unable to listen\n");
+			return EXIT_FAILURE;
+		}
+
+		/*
+		 * For clients asking for timestamps; accepted connections inherit
+		 * this. Where the kernel cannot give them, we take our own instead.
+		 */
+		(void) tsenable(w->s, 0);
+
+		w->cpu = -1;
+
+		if (pin) {
+			long ncpu;
+
+			ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+			w->cpu = ncpu > 0 ? (int) (i % ncpu) : (int) i;
+		}
+
+		w->tab.a = NULL;
+		w->tab.n = 0;
+
+		/* slabs are allocated as connections arrive, so idle workers cost nothing */
+		w->tab.slabs = NULL;
+		w->tab.free = NULL;
+	}
+
+	if (0 != setvbuf(stdout, NULL, _IOLBF, 0)) {
+		perror("setvbuf");
+		return EXIT_FAILURE;
+	}
+
+	/* TODO find "TCP" automatically */
+	printf("listening on %s:%s %s\n", argv[0], argv[1], "TCP/IP");
+
+	/*
+	 * The workers inherit this mask, so SIGINT and SIGTERM are left for
+	 * the main thread, which merges the counts on the way out.
+	 */
+	sigemptyset(&set);
+	(void) sigaddset(&set, SIGINT);
+	(void) sigaddset(&set, SIGTERM);
+
+	if (0 != pthread_sigmask(SIG_BLOCK, &set, NULL)) {
+		perror("pthread_sigmask");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		int e;
+
+		e = pthread_create(&workers[i].tid, NULL, work, &workers[i]);
+		if (e != 0) {
+			errno = e;
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (0 != sigwait(&set, &sig)) {
+		perror("sigwait");
+		return EXIT_FAILURE;
+	}
+
+	/* each worker closes its sockets, and its ring, once woken */
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < nworkers; i++) {
+		(void) shutdown(workers[i].s, SHUT_RDWR);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		(void) pthread_join(workers[i].tid, NULL);
+	}
+
+	count = 0;
+	calls = 0;
+	for (i = 0; i < nworkers; i++) {
+		count += __atomic_load_n(&workers[i].count, __ATOMIC_RELAXED);
+		calls += __atomic_load_n(&workers[i].calls, __ATOMIC_RELAXED);
+	}
+
+	printf("%lu messages answered, %lu syscalls, %.3f per message\n",
+		count, calls, count == 0 ? 0.0 : calls / (double) count);
+
+	free(workers);
+
+	return EXIT_SUCCESS;
+}
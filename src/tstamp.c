@@ -0,0 +1,197 @@
+/*
+ * Kernel software timestamps for sockets. See tstamp.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__) && !defined(NO_TIMESTAMPING)
+# include <netinet/in.h>
+# include <linux/net_tstamp.h>
+# include <linux/errqueue.h>
+# if defined(SO_TIMESTAMPING) && defined(SO_EE_ORIGIN_TIMESTAMPING) /* Linux 3.17 */
+#  define HAVE_TIMESTAMPING
+# endif
+#endif
+
+#include "tstamp.h"
+
+#ifdef HAVE_TIMESTAMPING
+
+/* enough for SCM_TIMESTAMPING and IP_RECVERR together */
+#define CMSG_SPACE_TS (CMSG_SPACE(sizeof (struct scm_timestamping)) \
+	+ CMSG_SPACE(sizeof (struct sock_extended_err) + sizeof (struct sockaddr_in)))
+
+static int64_t
+tstons(const struct scm_timestamping *tss)
+{
+	/* ts[0] is the software timestamp */
+	return (int64_t) tss->ts[0].tv_sec * 1000000000LL + tss->ts[0].tv_nsec;
+}
+
+#endif
+
+/* See tstamp.h */
+int
+tsenable(int s, int tx)
+{
+#ifdef HAVE_TIMESTAMPING
+	int flags;
+
+	flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE;
+
+	if (tx) {
+		flags |= SOF_TIMESTAMPING_TX_SOFTWARE
+		       | SOF_TIMESTAMPING_OPT_ID
+		       | SOF_TIMESTAMPING_OPT_TSONLY;
+	}
+
+	return setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof flags);
+#else
+	(void) s;
+	(void) tx;
+
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/* See tstamp.h */
+ssize_t
+tsrecv(int s, void *buf, size_t len, int flags,
+	struct sockaddr *sa, socklen_t *salen, int64_t *kts)
+{
+#ifdef HAVE_TIMESTAMPING
+	union {
+		char buf[CMSG_SPACE_TS];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t r;
+
+	assert(kts != NULL);
+
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_name       = sa;
+	msg.msg_namelen    = salen != NULL ? *salen : 0;
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+
+	*kts = 0;
+
+	r = recvmsg(s, &msg, flags);
+	if (r == -1) {
+		return -1;
+	}
+
+	if (salen != NULL) {
+		*salen = msg.msg_namelen;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			struct scm_timestamping tss;
+
+			memcpy(&tss, CMSG_DATA(cmsg), sizeof tss);
+			*kts = tstons(&tss);
+		}
+	}
+
+	return r;
+#else
+	assert(kts != NULL);
+
+	*kts = 0;
+
+	return recvfrom(s, buf, len, flags, sa, salen);
+#endif
+}
+
+/* See tstamp.h */
+int
+tstx(int s, uint32_t *id, int64_t *kts)
+{
+#ifdef HAVE_TIMESTAMPING
+	union {
+		char buf[CMSG_SPACE_TS];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	int64_t t;
+	int got;
+
+	assert(id != NULL);
+	assert(kts != NULL);
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+
+	if (-1 == recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+
+		return -1;
+	}
+
+	t   = 0;
+	got = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			struct scm_timestamping tss;
+
+			memcpy(&tss, CMSG_DATA(cmsg), sizeof tss);
+			t = tstons(&tss);
+			continue;
+		}
+
+		if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+		 || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+			struct sock_extended_err ee;
+
+			memcpy(&ee, CMSG_DATA(cmsg), sizeof ee);
+			if (ee.ee_origin == SO_EE_ORIGIN_TIMESTAMPING && ee.ee_info == SCM_TSTAMP_SND) {
+				*id = ee.ee_data;
+				got = 1;
+			}
+		}
+	}
+
+	if (!got || t == 0) {
+		/* something else on the error queue; nothing for us */
+		*id  = 0;
+		*kts = 0;
+		return 1;
+	}
+
+	*kts = t;
+
+	return 1;
+#else
+	(void) s;
+	(void) id;
+	(void) kts;
+
+	return 0;
+#endif
+}
+
@@ -0,0 +1,47 @@
+/*
+ * Kernel software timestamps for sockets, by way of SO_TIMESTAMPING.
+ *
+ * These are taken as packets pass through the network stack, and so exclude
+ * time spent waking up and running the process. They are CLOCK_REALTIME,
+ * in nanoseconds, and so are comparable only with one another.
+ *
+ * Where SO_TIMESTAMPING is unavailable, tsenable() fails with ENOTSUP,
+ * and tsrecv() gives no timestamps.
+ */
+
+#ifndef DG_TSTAMP_H
+#define DG_TSTAMP_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Request receive timestamps for s, and transmit timestamps also if tx is
+ * set. Transmit timestamps are keyed by a counter of datagrams sent, or for
+ * streams, the offset of the last byte of each send(), counting from 0
+ * when enabled. Returns -1 on error, with errno set.
+ */
+int
+tsenable(int s, int tx);
+
+/*
+ * As recvfrom(), also giving the kernel's receive timestamp in *kts,
+ * or 0 if there is none.
+ */
+ssize_t
+tsrecv(int s, void *buf, size_t len, int flags,
+	struct sockaddr *sa, socklen_t *salen, int64_t *kts);
+
+/*
+ * Take one message from the socket's error queue. Returns 1 for a message,
+ * 0 if there are none waiting, or -1 on error. *kts is 0 for messages which
+ * are not transmit timestamps.
+ */
+int
+tstx(int s, uint32_t *id, int64_t *kts);
+
+#endif
+
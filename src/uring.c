@@ -0,0 +1,296 @@
+/*
+ * A minimal io_uring(7) interface, by way of the raw syscalls.
+ * See uring.h.
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define LOAD_ACQ(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int
+sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int
+sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void
+addbuf(struct uring *u, unsigned short bid)
+{
+	struct io_uring_buf *b;
+
+	b = &u->br->bufs[u->brtail & (u->nbufs - 1)];
+	b->addr = (uintptr_t) (u->bufs + (size_t) bid * u->bufsz);
+	b->len  = u->bufsz;
+	b->bid  = bid;
+
+	u->brtail++;
+}
+
+/* See uring.h */
+int
+uring_init(struct uring *u, unsigned entries, unsigned nbufs, unsigned bufsz)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	int e;
+
+	assert(u != NULL);
+	assert(nbufs > 0 && (nbufs & (nbufs - 1)) == 0);
+	assert(nbufs <= 32768);
+	assert(bufsz % 8 == 0);
+
+	memset(u, 0, sizeof *u);
+	memset(&p, 0, sizeof p);
+
+	u->fd = sys_setup(entries, &p);
+	if (u->fd == -1) {
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(u->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	/* the SQ and CQ rings share a single mapping */
+	u->sqmapsz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	if (p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe) > u->sqmapsz) {
+		u->sqmapsz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	}
+
+	u->sqmap = mmap(NULL, u->sqmapsz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sqmap == MAP_FAILED) {
+		goto error;
+	}
+
+	u->sqessz = p.sq_entries * sizeof (struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqessz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		munmap(u->sqmap, u->sqmapsz);
+		goto error;
+	}
+
+	sq = u->sqmap;
+	cq = u->sqmap;
+
+	u->sq_head    = (void *) (sq + p.sq_off.head);
+	u->sq_tail    = (void *) (sq + p.sq_off.tail);
+	u->sq_array   = (void *) (sq + p.sq_off.array);
+	u->sq_mask    = *(unsigned *) (sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_local   = *u->sq_tail;
+
+	u->cq_head    = (void *) (cq + p.cq_off.head);
+	u->cq_tail    = (void *) (cq + p.cq_off.tail);
+	u->cq_mask    = *(unsigned *) (cq + p.cq_off.ring_mask);
+	u->cqes       = (void *) (cq + p.cq_off.cqes);
+
+	/* Provided buffers */
+	{
+		struct io_uring_buf_reg reg;
+		unsigned i;
+
+		u->nbufs = nbufs;
+		u->bufsz = bufsz;
+
+		u->br = mmap(NULL, nbufs * sizeof (struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (u->br == MAP_FAILED) {
+			goto fail;
+		}
+
+		u->bufs = mmap(NULL, (size_t) nbufs * bufsz,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (u->bufs == MAP_FAILED) {
+			munmap(u->br, nbufs * sizeof (struct io_uring_buf));
+			goto fail;
+		}
+
+		memset(&reg, 0, sizeof reg);
+		reg.ring_addr    = (uintptr_t) u->br;
+		reg.ring_entries = nbufs;
+		reg.bgid         = 0;
+
+		if (-1 == sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+			e = errno;
+			munmap(u->bufs, (size_t) nbufs * bufsz);
+			munmap(u->br, nbufs * sizeof (struct io_uring_buf));
+			errno = e;
+			goto fail;
+		}
+
+		u->brtail = 0;
+		for (i = 0; i < nbufs; i++) {
+			addbuf(u, i);
+		}
+
+		STORE_REL(&u->br->tail, u->brtail);
+	}
+
+	return 0;
+
+fail:
+
+	e = errno;
+	munmap(u->sqes, u->sqessz);
+	munmap(u->sqmap, u->sqmapsz);
+	errno = e;
+
+error:
+
+	e = errno;
+	close(u->fd);
+	errno = e;
+
+	return -1;
+}
+
+/* See uring.h */
+void
+uring_fini(struct uring *u)
+{
+	assert(u != NULL);
+
+	munmap(u->bufs, (size_t) u->nbufs * u->bufsz);
+	munmap(u->br, u->nbufs * sizeof (struct io_uring_buf));
+	munmap(u->sqes, u->sqessz);
+	munmap(u->sqmap, u->sqmapsz);
+	close(u->fd);
+}
+
+/* See uring.h */
+struct io_uring_sqe *
+uring_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	assert(u != NULL);
+
+	/* the kernel takes everything submitted, unless its completions are backed up */
+	if (u->sq_local - LOAD_ACQ(u->sq_head) >= u->sq_entries) {
+		if (-1 == uring_submit(u, 0)) {
+			return NULL;
+		}
+
+		if (u->sq_local - LOAD_ACQ(u->sq_head) >= u->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	i = u->sq_local & u->sq_mask;
+	u->sq_array[i] = i;
+	u->sq_local++;
+
+	sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof *sqe);
+
+	return sqe;
+}
+
+/* See uring.h */
+int
+uring_submit(struct uring *u, unsigned wait)
+{
+	unsigned n;
+	int r;
+
+	assert(u != NULL);
+
+	/* including any left unconsumed by an earlier EBUSY */
+	n = u->sq_local - LOAD_ACQ(u->sq_head);
+	STORE_REL(u->sq_tail, u->sq_local);
+
+	do {
+		r = sys_enter(u->fd, n, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (r == -1 && errno == EINTR);
+
+	if (r == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* See uring.h */
+struct io_uring_cqe *
+uring_cqe(struct uring *u)
+{
+	unsigned head;
+
+	assert(u != NULL);
+
+	head = *u->cq_head;
+	if (head == LOAD_ACQ(u->cq_tail)) {
+		return NULL;
+	}
+
+	return &u->cqes[head & u->cq_mask];
+}
+
+/* See uring.h */
+void
+uring_seen(struct uring *u)
+{
+	assert(u != NULL);
+
+	STORE_REL(u->cq_head, *u->cq_head + 1);
+}
+
+/* See uring.h */
+void *
+uring_buf(struct uring *u, const struct io_uring_cqe *cqe)
+{
+	assert(u != NULL);
+	assert(cqe != NULL);
+	assert(cqe->flags & IORING_CQE_F_BUFFER);
+
+	return u->bufs + (size_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * u->bufsz;
+}
+
+/* See uring.h */
+void
+uring_recycle(struct uring *u, const struct io_uring_cqe *cqe)
+{
+	assert(u != NULL);
+	assert(cqe != NULL);
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+		return;
+	}
+
+	addbuf(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	STORE_REL(&u->br->tail, u->brtail);
+}
+
+#endif
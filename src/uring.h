@@ -0,0 +1,107 @@
+/*
+ * A minimal io_uring(7) interface for the daemons, by way of the raw
+ * syscalls (we do not depend on liburing).
+ *
+ * HAVE_URING is defined when this is available at build time. Whether the
+ * running kernel supports it is established by uring_init(); the features
+ * used here (provided buffer rings and multishot receives) need Linux 6.0.
+ */
+
+#ifndef DG_URING_H
+#define DG_URING_H
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__) && !defined(NO_URING)
+# if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#   include <stddef.h>
+#   include <linux/io_uring.h>
+#   if defined(IORING_RECV_MULTISHOT) /* Linux 6.0 */
+#    define HAVE_URING
+#   endif
+#  endif
+# endif
+#endif
+
+#ifdef HAVE_URING
+
+struct uring {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local; /* our tail; published by uring_submit() */
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sqmap;
+	size_t sqmapsz;
+	size_t sqessz;
+
+	/* buffers provided to the kernel for receives, group 0 */
+	struct io_uring_buf_ring *br;
+	unsigned char *bufs;
+	unsigned nbufs;
+	unsigned bufsz;
+	unsigned short brtail;
+};
+
+/*
+ * Create a ring of the given number of entries, and register nbufs
+ * receive buffers of bufsz bytes each. bufsz must be a multiple of 8, so
+ * that each buffer's struct io_uring_recvmsg_out is aligned.
+ * Returns -1 on error, with errno set.
+ */
+int
+uring_init(struct uring *u, unsigned entries, unsigned nbufs, unsigned bufsz);
+
+void
+uring_fini(struct uring *u);
+
+/*
+ * Return a zeroed submission queue entry. The ring is submitted to make
+ * room, if full. Returns NULL on error; EBUSY means the kernel will take
+ * no more until completions are reaped, and the caller should try again
+ * after that.
+ */
+struct io_uring_sqe *
+uring_sqe(struct uring *u);
+
+/*
+ * Submit everything prepared so far, and wait for at least `wait`
+ * completions. Returns -1 on error. EBUSY and EAGAIN say that nothing
+ * was submitted, for want of room for completions; those ready should be
+ * reaped, and the submission tried again.
+ */
+int
+uring_submit(struct uring *u, unsigned wait);
+
+/*
+ * Return the next completion, or NULL if none are ready. Each completion
+ * must be released by uring_seen() once it has been dealt with.
+ */
+struct io_uring_cqe *
+uring_cqe(struct uring *u);
+
+void
+uring_seen(struct uring *u);
+
+/*
+ * The provided buffer for a completion flagged IORING_CQE_F_BUFFER,
+ * and its return to the kernel after use.
+ */
+void *
+uring_buf(struct uring *u, const struct io_uring_cqe *cqe);
+
+void
+uring_recycle(struct uring *u, const struct io_uring_cqe *cqe);
+
+#endif
+
+#endif